@@ -0,0 +1,553 @@
+/*
+ * Copyright (c) 2021 Miguel Rodrigues <miguelangelorodrigues@enta.pt>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Renders the example/assets/testN.must templates with their testN.json in
+ * a tight loop and reports how fast it went. Run it from the top directory
+ * after make bench:
+ *
+ *      bench/bench [-csSu] [-b baseline] [-t percent] [-n iterations]
+ *          [-w warmup] [-d directory] [test ...]
+ *
+ * Tests are named test1 or just 1, all of them run by default. -s renders
+ * with kore_mustach_json(), compiling the template on every render like
+ * releases without compiled templates do. -S prints what the last render
+ * of every test did, from kore_mustach_stats_ctx().
+ *
+ * -c checks the output of every test against its testN.ref first. -b
+ * compares p50 latency and allocations against a baseline file, failing
+ * a test that got slower by more than -t percent (10 by default) or that
+ * allocates more. The baseline is written instead when the file does not
+ * exist yet or -u is given. The exit status is 1 if any test failed.
+ */
+
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+
+#include <kore/kore.h>
+
+#include "kore_mustach.h"
+
+#define BENCH_TESTS         64
+#define BENCH_ITERATIONS    10000
+#define BENCH_THRESHOLD     10
+
+struct bench {
+    char                            name[32];
+    char                            *template;
+    char                            *data;
+    char                            *ref;
+    struct kore_json                json;
+    struct kore_mustach_template    *tpl;
+};
+
+struct result {
+    u_int64_t   elapsed;
+    u_int64_t   p50;
+    u_int64_t   p99;
+    size_t      bytes;
+    double      allocs;
+};
+
+struct baseline {
+    char        name[32];
+    u_int64_t   p50;
+    double      allocs;
+};
+
+void upper(struct kore_mustach_ctx *, struct kore_buf *, size_t);
+void lower(struct kore_mustach_ctx *, struct kore_buf *, size_t);
+void taxed_value(struct kore_buf *);
+
+static void         usage(void);
+static char         *slurp(const char *);
+static u_int64_t    now_ns(void);
+static int          cmp_u64(const void *, const void *);
+static int          bench_load(struct bench *, const char *);
+static void         bench_cleanup(struct bench *);
+static int          bench_run(struct bench *, int, int, int, struct result *);
+static int          bench_check(struct bench *, int);
+static void         bench_stats(void);
+static int          baseline_load(const char *);
+static void         baseline_save(const char *, struct baseline *, int);
+static struct baseline  *baseline_find(const char *);
+
+static struct kore_mustach_ctx *ctx = NULL;
+static struct baseline  baselines[BENCH_TESTS];
+static int              nbaselines = 0;
+
+int
+main(int argc, char **argv)
+{
+    struct bench    tests[BENCH_TESTS];
+    struct baseline measured[BENCH_TESTS], *base;
+    struct result   res;
+    const char      *dir = "example", *basefile = NULL;
+    char            name[32], cwd[PATH_MAX];
+    int             ch, i, n, count, iterations, warmup, string, rc;
+    int             check, update, threshold, stats;
+    double          slower;
+
+    string = check = update = stats = 0;
+    warmup = -1;
+    iterations = BENCH_ITERATIONS;
+    threshold = BENCH_THRESHOLD;
+
+    while ((ch = getopt(argc, argv, "b:cd:hn:sSt:uw:")) != -1) {
+        switch (ch) {
+            case 'b':
+                basefile = optarg;
+                break;
+            case 'c':
+                check = 1;
+                break;
+            case 'd':
+                dir = optarg;
+                break;
+            case 'n':
+                iterations = atoi(optarg);
+                break;
+            case 's':
+                string = 1;
+                break;
+            case 'S':
+                stats = 1;
+                break;
+            case 't':
+                threshold = atoi(optarg);
+                break;
+            case 'u':
+                update = 1;
+                break;
+            case 'w':
+                warmup = atoi(optarg);
+                break;
+            default:
+                usage();
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (iterations <= 0)
+        usage();
+
+    if (warmup < 0)
+        warmup = iterations / 10;
+
+    /* the baseline path is relative to where we were started */
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        fprintf(stderr, "getcwd: %s\n", strerror(errno));
+        return (1);
+    }
+
+    if (basefile != NULL && !update && !baseline_load(basefile))
+        update = 1;
+
+    /* partials are looked up relative to the example directory */
+    if (chdir(dir) == -1) {
+        fprintf(stderr, "chdir(%s): %s\n", dir, strerror(errno));
+        return (1);
+    }
+
+    kore_mustach_register_lambda_inplace("upper", upper);
+    kore_mustach_register_lambda_inplace("lower", lower);
+    kore_mustach_register_lambda("taxed_value", taxed_value);
+
+    count = 0;
+    if (argc == 0) {
+        for (n = 1; count < BENCH_TESTS; n++) {
+            snprintf(name, sizeof(name), "test%d", n);
+            if (!bench_load(&tests[count], name))
+                break;
+            count++;
+        }
+    } else {
+        for (i = 0; i < argc && count < BENCH_TESTS; i++) {
+            if (isdigit((unsigned char)argv[i][0]))
+                snprintf(name, sizeof(name), "test%s", argv[i]);
+            else
+                snprintf(name, sizeof(name), "%s", argv[i]);
+
+            if (!bench_load(&tests[count], name)) {
+                fprintf(stderr, "%s: cannot load %s/assets/%s.must\n", name, dir, name);
+                return (1);
+            }
+            count++;
+        }
+    }
+
+    ctx = kore_mustach_ctx_alloc();
+
+    printf("%-8s %12s %12s %10s %10s %10s %10s %8s\n", "test", "renders/s",
+        "ns/render", "p50", "p99", "MB/s", "bytes", "allocs");
+
+    for (i = 0, rc = 0; i < count; i++) {
+        if (check && !bench_check(&tests[i], string)) {
+            rc = 1;
+            continue;
+        }
+
+        if (!bench_run(&tests[i], iterations, warmup, string, &res)) {
+            printf("%-8s error: %s\n", tests[i].name,
+                string ? kore_mustach_strerror() : kore_mustach_strerror_ctx(ctx));
+            rc = 1;
+            continue;
+        }
+
+        printf("%-8s %12.0f %12.0f %10" PRIu64 " %10" PRIu64 " %10.1f %10zu %8.1f",
+            tests[i].name, iterations * 1e9 / res.elapsed,
+            (double)res.elapsed / iterations, res.p50, res.p99,
+            (double)res.bytes * iterations * 1e3 / res.elapsed, res.bytes,
+            res.allocs);
+
+        memcpy(measured[i].name, tests[i].name, sizeof(measured[i].name));
+        measured[i].p50 = res.p50;
+        measured[i].allocs = res.allocs;
+
+        if (basefile != NULL && !update) {
+            if ((base = baseline_find(tests[i].name)) == NULL) {
+                printf("  no baseline");
+            } else if (res.allocs > base->allocs) {
+                printf("  FAIL allocs %.1f > %.1f", res.allocs, base->allocs);
+                rc = 1;
+            } else {
+                slower = (double)res.p50 * 100 / base->p50 - 100;
+                if (slower > threshold) {
+                    printf("  FAIL p50 +%.1f%%", slower);
+                    rc = 1;
+                } else {
+                    printf("  ok p50 %+.1f%%", slower);
+                }
+            }
+        }
+
+        printf("\n");
+
+        if (stats && !string)
+            bench_stats();
+    }
+
+    if (basefile != NULL && update && rc == 0) {
+        if (chdir(cwd) == -1) {
+            fprintf(stderr, "chdir(%s): %s\n", cwd, strerror(errno));
+            rc = 1;
+        } else {
+            baseline_save(basefile, measured, count);
+        }
+    }
+
+    for (i = 0; i < count; i++)
+        bench_cleanup(&tests[i]);
+
+    kore_mustach_ctx_free(ctx);
+    return (rc);
+}
+
+void
+usage(void)
+{
+    fprintf(stderr,
+        "usage: bench [-csSu] [-b baseline] [-t percent] [-n iterations]\n"
+        "             [-w warmup] [-d directory] [test ...]\n");
+    exit(1);
+}
+
+int
+bench_load(struct bench *b, const char *name)
+{
+    char    path[PATH_MAX];
+
+    memset(b, 0, sizeof(*b));
+    snprintf(b->name, sizeof(b->name), "%s", name);
+
+    snprintf(path, sizeof(path), "assets/%s.must", name);
+    if ((b->template = slurp(path)) == NULL)
+        return (KORE_RESULT_ERROR);
+
+    snprintf(path, sizeof(path), "assets/%s.json", name);
+    if ((b->data = slurp(path)) == NULL) {
+        kore_free(b->template);
+        return (KORE_RESULT_ERROR);
+    }
+
+    /* only needed for -c */
+    snprintf(path, sizeof(path), "assets/%s.ref", name);
+    b->ref = slurp(path);
+
+    kore_json_init(&b->json, b->data, strlen(b->data));
+    if (!kore_json_parse(&b->json)) {
+        fprintf(stderr, "%s: %s\n", name, kore_json_strerror());
+        bench_cleanup(b);
+        return (KORE_RESULT_ERROR);
+    }
+
+    b->tpl = kore_mustach_compile(b->template, Mustach_With_AllExtensions);
+
+    return (KORE_RESULT_OK);
+}
+
+void
+bench_cleanup(struct bench *b)
+{
+    kore_mustach_template_free(b->tpl);
+    kore_json_cleanup(&b->json);
+    kore_free(b->template);
+    kore_free(b->data);
+    kore_free(b->ref);
+}
+
+/* Renders 'b' once and compares the output with its reference. */
+int
+bench_check(struct bench *b, int string)
+{
+    struct kore_buf *result;
+    size_t          i, len;
+    int             ok;
+
+    if (b->ref == NULL) {
+        printf("%-8s FAIL no assets/%s.ref\n", b->name, b->name);
+        return (KORE_RESULT_ERROR);
+    }
+
+    if (string)
+        ok = kore_mustach_json(b->template, b->json.root, Mustach_With_AllExtensions, &result);
+    else if (b->tpl != NULL)
+        ok = kore_mustach_render_ctx(ctx, b->tpl, b->json.root, &result);
+    else
+        ok = KORE_RESULT_ERROR;
+
+    if (!ok) {
+        printf("%-8s FAIL error: %s\n", b->name,
+            string || b->tpl == NULL ? kore_mustach_strerror() : kore_mustach_strerror_ctx(ctx));
+        return (KORE_RESULT_ERROR);
+    }
+
+    len = strlen(b->ref);
+    for (i = 0; i < result->offset && i < len; i++) {
+        if (result->data[i] != (u_int8_t)b->ref[i])
+            break;
+    }
+
+    if (i != len || i != result->offset) {
+        printf("%-8s FAIL output differs from assets/%s.ref at byte %zu\n",
+            b->name, b->name, i);
+        ok = KORE_RESULT_ERROR;
+    }
+
+    kore_buf_free(result);
+    return (ok);
+}
+
+void
+bench_stats(void)
+{
+    struct kore_mustach_stats   st;
+
+    kore_mustach_stats_ctx(ctx, &st);
+    printf("         %" PRIu64 " tags, %" PRIu64 " sections, %" PRIu64 " iterations, "
+        "%" PRIu64 " lookups (%" PRIu64 " missed, %" PRIu64 " frames), "
+        "%" PRIu64 " partials, %" PRIu64 " lambdas, %" PRIu64 " cached, "
+        "%" PRIu64 " bytes (%" PRIu64 " escaped), %" PRIu64 " allocations\n",
+        st.tags, st.sections, st.iterations, st.lookups, st.misses, st.frames,
+        st.partials, st.lambdas, st.fragments, st.emitted, st.escaped, st.allocs);
+}
+
+/*
+ * A baseline file holds one line per test: its name, p50 latency in
+ * nanoseconds and allocations per render.
+ */
+int
+baseline_load(const char *path)
+{
+    struct baseline *b;
+    FILE            *fp;
+    char            line[128];
+
+    if ((fp = fopen(path, "r")) == NULL)
+        return (KORE_RESULT_ERROR);
+
+    while (nbaselines < BENCH_TESTS && fgets(line, sizeof(line), fp) != NULL) {
+        b = &baselines[nbaselines];
+        if (sscanf(line, "%31s %" SCNu64 " %lf", b->name, &b->p50, &b->allocs) == 3)
+            nbaselines++;
+    }
+
+    fclose(fp);
+    return (KORE_RESULT_OK);
+}
+
+void
+baseline_save(const char *path, struct baseline *b, int count)
+{
+    FILE    *fp;
+    int     i;
+
+    if ((fp = fopen(path, "w")) == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    for (i = 0; i < count; i++)
+        fprintf(fp, "%s %" PRIu64 " %.1f\n", b[i].name, b[i].p50, b[i].allocs);
+
+    fclose(fp);
+    printf("baseline written to %s\n", path);
+}
+
+struct baseline *
+baseline_find(const char *name)
+{
+    int     i;
+
+    for (i = 0; i < nbaselines; i++) {
+        if (!strcmp(baselines[i].name, name))
+            return (&baselines[i]);
+    }
+
+    return (NULL);
+}
+
+/*
+ * Times every single render, after 'warmup' renders that are not counted
+ * so caches, the partial cache included, are warm.
+ */
+int
+bench_run(struct bench *b, int iterations, int warmup, int string, struct result *res)
+{
+    struct kore_buf *result;
+    u_int64_t       *samples, start, allocs;
+    int             i, ok;
+
+    if (b->tpl == NULL && !string)
+        return (KORE_RESULT_ERROR);
+
+    samples = kore_calloc(iterations, sizeof(*samples));
+    memset(res, 0, sizeof(*res));
+
+    allocs = 0;
+    for (i = -warmup, ok = 1; i < iterations && ok; i++) {
+        if (i == 0)
+            allocs = kore_shim_allocs;
+
+        start = now_ns();
+        if (string)
+            ok = kore_mustach_json(b->template, b->json.root, Mustach_With_AllExtensions, &result);
+        else
+            ok = kore_mustach_render_ctx(ctx, b->tpl, b->json.root, &result);
+
+        if (i >= 0)
+            samples[i] = now_ns() - start;
+
+        if (ok) {
+            res->bytes = result->offset;
+            kore_buf_free(result);
+        }
+    }
+
+    if (ok) {
+        res->allocs = (double)(kore_shim_allocs - allocs) / iterations;
+
+        for (i = 0; i < iterations; i++)
+            res->elapsed += samples[i];
+
+        qsort(samples, iterations, sizeof(*samples), cmp_u64);
+        res->p50 = samples[iterations / 2];
+        res->p99 = samples[(size_t)iterations * 99 / 100];
+    }
+
+    kore_free(samples);
+    return (ok);
+}
+
+char *
+slurp(const char *path)
+{
+    struct stat st;
+    FILE        *fp;
+    char        *data;
+    size_t      len;
+
+    if ((fp = fopen(path, "r")) == NULL)
+        return (NULL);
+
+    if (fstat(fileno(fp), &st) == -1) {
+        fclose(fp);
+        return (NULL);
+    }
+
+    data = kore_malloc(st.st_size + 1);
+    len = fread(data, 1, st.st_size, fp);
+    data[len] = '\0';
+    fclose(fp);
+
+    return (data);
+}
+
+u_int64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+int
+cmp_u64(const void *a, const void *b)
+{
+    u_int64_t   x = *(const u_int64_t *)a, y = *(const u_int64_t *)b;
+
+    return ((x > y) - (x < y));
+}
+
+/* the lambdas of the example module */
+void
+upper(struct kore_mustach_ctx *render, struct kore_buf *b, size_t off)
+{
+    u_int8_t    *c, *end = b->data + b->offset;
+
+    (void)render;
+
+    for (c = b->data + off; c < end; c++)
+        *c = toupper(*c);
+}
+
+void
+lower(struct kore_mustach_ctx *render, struct kore_buf *b, size_t off)
+{
+    u_int8_t    *c, *end = b->data + b->offset;
+
+    (void)render;
+
+    for (c = b->data + off; c < end; c++)
+        *c = tolower(*c);
+}
+
+void
+taxed_value(struct kore_buf *b)
+{
+    struct kore_json_item   *o;
+
+    kore_buf_reset(b);
+    if ((o = kore_mustach_find("value")) != NULL && o->type == KORE_JSON_TYPE_INTEGER)
+        kore_buf_appendf(b, "%g", o->data.integer * 0.6);
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2021 Miguel Rodrigues <miguelangelorodrigues@enta.pt>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Minimal stand-in for <kore/http.h>. Responses are written to the
+ * connection's file descriptor as plain bytes.
+ */
+
+#ifndef KORE_SHIM_HTTP_H
+#define KORE_SHIM_HTTP_H
+
+#define HTTP_METHOD_GET     0
+#define HTTP_METHOD_HEAD    2
+
+#define HTTP_REQUEST_COMPLETE           0x0001
+#define HTTP_REQUEST_NO_CONTENT_LENGTH  0x0080
+#define HTTP_VERSION_1_1                0x1000
+#define HTTP_VERSION_1_0                0x2000
+
+struct connection {
+    int             fd;
+    u_int64_t       sent;
+    struct netbuf   *streams;   /* written, released by net_send_flush() */
+};
+
+struct http_request {
+    u_int8_t            method;
+    int                 status;
+    int                 flags;
+    const char          *path;
+    struct connection   *owner;
+    struct kore_buf     headers;
+};
+
+void    http_response(struct http_request *, int, const void *, size_t);
+void    http_response_header(struct http_request *, const char *, const char *);
+int     http_request_header(struct http_request *, const char *, const char **);
+
+void    net_send_queue(struct connection *, const void *, size_t);
+void    net_send_stream(struct connection *, void *, size_t,
+            int (*)(struct netbuf *), struct netbuf **);
+int     net_send_flush(struct connection *);
+void    kore_connection_disconnect(struct connection *);
+
+#endif
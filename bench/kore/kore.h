@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2021 Miguel Rodrigues <miguelangelorodrigues@enta.pt>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Minimal stand-in for <kore/kore.h>, just enough of kore's buffer, json
+ * and runtime API to run kore_mustach.c outside of a kore server.
+ * Layouts and semantics follow kore's own headers.
+ */
+
+#ifndef KORE_SHIM_H
+#define KORE_SHIM_H
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/time.h>
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#define KORE_RESULT_ERROR   0
+#define KORE_RESULT_OK      1
+
+struct kore_buf {
+    u_int8_t    *data;
+    int         flags;
+    size_t      length;
+    size_t      offset;
+};
+
+struct kore_runtime {
+    int         type;
+};
+
+#define NETBUF_IS_STREAM    0x10
+
+struct netbuf {
+    u_int8_t        *buf;
+    size_t          b_len;
+    int             flags;
+    void            *extra;
+    int             (*cb)(struct netbuf *);
+    struct netbuf   *next;
+};
+
+struct kore_runtime_call {
+    void                *addr;
+    struct kore_runtime *runtime;
+};
+
+#define KORE_JSON_TYPE_OBJECT       0x0001
+#define KORE_JSON_TYPE_ARRAY        0x0002
+#define KORE_JSON_TYPE_STRING       0x0004
+#define KORE_JSON_TYPE_NUMBER       0x0008
+#define KORE_JSON_TYPE_LITERAL      0x0010
+#define KORE_JSON_TYPE_INTEGER      0x0020
+#define KORE_JSON_TYPE_INTEGER_U64  0x0040
+
+#define KORE_JSON_FALSE     0
+#define KORE_JSON_TRUE      1
+#define KORE_JSON_NULL      2
+
+#define KORE_JSON_DEPTH_MAX 10
+
+#define KORE_JSON_ERR_NONE              0
+#define KORE_JSON_ERR_INVALID_OBJECT    1
+#define KORE_JSON_ERR_INVALID_ARRAY     2
+#define KORE_JSON_ERR_INVALID_STRING    3
+#define KORE_JSON_ERR_INVALID_NUMBER    4
+#define KORE_JSON_ERR_INVALID_LITERAL   5
+#define KORE_JSON_ERR_DEPTH             6
+#define KORE_JSON_ERR_EOF               7
+#define KORE_JSON_ERR_INVALID_JSON      8
+#define KORE_JSON_ERR_INVALID_SEARCH    9
+#define KORE_JSON_ERR_NOT_FOUND         10
+#define KORE_JSON_ERR_TYPE_MISMATCH     11
+#define KORE_JSON_ERR_LAST              12
+
+struct kore_json {
+    const u_int8_t          *data;
+    int                     depth;
+    size_t                  length;
+    size_t                  offset;
+    struct kore_buf         tmpbuf;
+    struct kore_json_item   *root;
+};
+
+struct kore_json_item {
+    u_int32_t               type;
+    char                    *name;
+    struct kore_json_item   *parent;
+
+    union {
+        TAILQ_HEAD(, kore_json_item)    items;
+        char                            *string;
+        double                          number;
+        int                             literal;
+        int64_t                         integer;
+        u_int64_t                       u64;
+    } data;
+
+    TAILQ_ENTRY(kore_json_item) list;
+};
+
+#define kore_json_create_object(o, n)                       \
+    kore_json_create_item(o, n, KORE_JSON_TYPE_OBJECT)
+#define kore_json_create_array(o, n)                        \
+    kore_json_create_item(o, n, KORE_JSON_TYPE_ARRAY)
+#define kore_json_create_string(o, n, v)                    \
+    kore_json_create_item(o, n, KORE_JSON_TYPE_STRING, v)
+#define kore_json_create_number(o, n, v)                    \
+    kore_json_create_item(o, n, KORE_JSON_TYPE_NUMBER, (double)v)
+#define kore_json_create_integer(o, n, v)                   \
+    kore_json_create_item(o, n, KORE_JSON_TYPE_INTEGER, (int64_t)v)
+#define kore_json_create_integer_u64(o, n, v)               \
+    kore_json_create_item(o, n, KORE_JSON_TYPE_INTEGER_U64, (u_int64_t)v)
+#define kore_json_create_literal(o, n, v)                   \
+    kore_json_create_item(o, n, KORE_JSON_TYPE_LITERAL, (int)v)
+
+/* allocation counters, kept by the shim for the bench reports */
+extern u_int64_t    kore_shim_allocs;
+extern u_int64_t    kore_shim_frees;
+
+void    *kore_malloc(size_t);
+void    *kore_calloc(size_t, size_t);
+void    *kore_realloc(void *, size_t);
+void    kore_free(void *);
+char    *kore_strdup(const char *);
+size_t  kore_strlcpy(char *, const char *, const size_t);
+int     kore_split_string(char *, const char *, char **, size_t);
+int64_t kore_strtonum64(const char *, int, int *);
+double  kore_strtodouble(const char *, long double, long double, int *);
+u_int64_t   kore_time_ms(void);
+void    kore_log(int, const char *, ...) __attribute__((format (printf, 2, 3)));
+
+struct kore_buf *kore_buf_alloc(size_t);
+void    kore_buf_init(struct kore_buf *, size_t);
+void    kore_buf_free(struct kore_buf *);
+void    kore_buf_cleanup(struct kore_buf *);
+void    kore_buf_reset(struct kore_buf *);
+void    kore_buf_append(struct kore_buf *, const void *, size_t);
+void    kore_buf_appendf(struct kore_buf *, const char *, ...) __attribute__((format (printf, 2, 3)));
+void    kore_buf_appendv(struct kore_buf *, const char *, va_list);
+u_int8_t    *kore_buf_release(struct kore_buf *, size_t *);
+char    *kore_buf_stringify(struct kore_buf *, size_t *);
+void    kore_buf_replace_string(struct kore_buf *, const char *, void *, size_t);
+
+void    kore_json_init(struct kore_json *, const void *, size_t);
+int     kore_json_parse(struct kore_json *);
+void    kore_json_cleanup(struct kore_json *);
+int     kore_json_errno(void);
+const char  *kore_json_strerror(void);
+void    kore_json_item_free(struct kore_json_item *);
+void    kore_json_item_tobuf(struct kore_json_item *, struct kore_buf *);
+void    kore_json_item_attach(struct kore_json_item *, struct kore_json_item *);
+struct kore_json_item   *kore_json_find(struct kore_json_item *, const char *, u_int32_t);
+struct kore_json_item   *kore_json_create_item(struct kore_json_item *, const char *, u_int32_t, ...);
+
+struct kore_runtime_call    *kore_runtime_getcall(const char *);
+
+#endif
@@ -0,0 +1,1042 @@
+/*
+ * Copyright (c) 2021 Miguel Rodrigues <miguelangelorodrigues@enta.pt>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Minimal implementation of the kore API used by kore_mustach.c, so the
+ * library can be benchmarked without a kore server.
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <stddef.h>
+
+#include <kore/kore.h>
+#include <kore/http.h>
+
+/* counted atomically, pool threads allocate too as they would with tasks */
+u_int64_t   kore_shim_allocs = 0;
+u_int64_t   kore_shim_frees = 0;
+
+static int  json_errno = KORE_JSON_ERR_NONE;
+
+static const char *json_errtab[] = {
+    "no error",
+    "invalid object",
+    "invalid array",
+    "invalid string",
+    "invalid number",
+    "invalid literal",
+    "too deep",
+    "eof",
+    "invalid json",
+    "invalid search query",
+    "item not found",
+    "item found, type mismatch",
+};
+
+static int  json_peek(struct kore_json *);
+static int  json_value(struct kore_json *, struct kore_json_item *, const char *);
+static int  json_string(struct kore_json *, char **);
+static int  json_number(struct kore_json *, struct kore_json_item *);
+static int  json_literal(struct kore_json *, struct kore_json_item *);
+static struct kore_json_item    *json_item(struct kore_json_item *, const char *, u_int32_t);
+static void json_string_tobuf(const char *, struct kore_buf *);
+static void net_release(struct connection *);
+
+void *
+kore_malloc(size_t len)
+{
+    void    *p;
+
+    if ((p = malloc(len == 0 ? 1 : len)) == NULL)
+        abort();
+
+    __atomic_add_fetch(&kore_shim_allocs, 1, __ATOMIC_RELAXED);
+    return (p);
+}
+
+void *
+kore_calloc(size_t n, size_t len)
+{
+    void    *p;
+
+    if ((p = calloc(n == 0 ? 1 : n, len == 0 ? 1 : len)) == NULL)
+        abort();
+
+    __atomic_add_fetch(&kore_shim_allocs, 1, __ATOMIC_RELAXED);
+    return (p);
+}
+
+void *
+kore_realloc(void *ptr, size_t len)
+{
+    void    *p;
+
+    if ((p = realloc(ptr, len == 0 ? 1 : len)) == NULL)
+        abort();
+
+    if (ptr == NULL)
+        __atomic_add_fetch(&kore_shim_allocs, 1, __ATOMIC_RELAXED);
+    return (p);
+}
+
+void
+kore_free(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+
+    __atomic_add_fetch(&kore_shim_frees, 1, __ATOMIC_RELAXED);
+    free(ptr);
+}
+
+char *
+kore_strdup(const char *str)
+{
+    size_t  len = strlen(str) + 1;
+    char    *p = kore_malloc(len);
+
+    memcpy(p, str, len);
+    return (p);
+}
+
+size_t
+kore_strlcpy(char *dst, const char *src, const size_t len)
+{
+    size_t  n = strlen(src);
+
+    if (len != 0) {
+        if (n < len) {
+            memcpy(dst, src, n + 1);
+        } else {
+            memcpy(dst, src, len - 1);
+            dst[len - 1] = '\0';
+        }
+    }
+    return (n);
+}
+
+int
+kore_split_string(char *input, const char *delim, char **out, size_t ele)
+{
+    int     count = 0;
+    char    **ap;
+
+    if (ele == 0)
+        return (0);
+
+    for (ap = out; ap < &out[ele - 1] &&
+            (*ap = strsep(&input, delim)) != NULL;) {
+        if (**ap != '\0') {
+            ap++;
+            count++;
+        }
+    }
+
+    *ap = NULL;
+    return (count);
+}
+
+int64_t
+kore_strtonum64(const char *str, int sign, int *err)
+{
+    int64_t     l;
+    long long   ll;
+    char        *ep;
+
+    errno = 0;
+    *err = KORE_RESULT_ERROR;
+
+    if (sign) {
+        ll = strtoll(str, &ep, 10);
+        if ((ll == LLONG_MIN || ll == LLONG_MAX) && errno == ERANGE)
+            return (0);
+        l = ll;
+    } else {
+        if (str[0] == '-')
+            return (0);
+        l = (int64_t)strtoull(str, &ep, 10);
+        if ((u_int64_t)l == ULLONG_MAX && errno == ERANGE)
+            return (0);
+    }
+
+    if (str == ep || *ep != '\0')
+        return (0);
+
+    *err = KORE_RESULT_OK;
+    return (l);
+}
+
+double
+kore_strtodouble(const char *str, long double min, long double max, int *err)
+{
+    double  d;
+    char    *ep;
+
+    errno = 0;
+    *err = KORE_RESULT_ERROR;
+
+    d = strtod(str, &ep);
+    if (str == ep || *ep != '\0' || errno == ERANGE)
+        return (0);
+
+    if (d < min || d > max)
+        return (0);
+
+    *err = KORE_RESULT_OK;
+    return (d);
+}
+
+u_int64_t
+kore_time_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((u_int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+void
+kore_log(int prio, const char *fmt, ...)
+{
+    va_list args;
+
+    (void)prio;
+
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
+
+struct kore_buf *
+kore_buf_alloc(size_t initial)
+{
+    struct kore_buf *buf;
+
+    buf = kore_malloc(sizeof(*buf));
+    kore_buf_init(buf, initial);
+    return (buf);
+}
+
+void
+kore_buf_init(struct kore_buf *buf, size_t initial)
+{
+    if (initial > 0)
+        buf->data = kore_malloc(initial);
+    else
+        buf->data = NULL;
+
+    buf->length = initial;
+    buf->offset = 0;
+    buf->flags = 0;
+}
+
+void
+kore_buf_free(struct kore_buf *buf)
+{
+    kore_buf_cleanup(buf);
+    kore_free(buf);
+}
+
+void
+kore_buf_cleanup(struct kore_buf *buf)
+{
+    kore_free(buf->data);
+    buf->data = NULL;
+    buf->offset = 0;
+    buf->length = 0;
+}
+
+void
+kore_buf_reset(struct kore_buf *buf)
+{
+    buf->offset = 0;
+}
+
+void
+kore_buf_append(struct kore_buf *buf, const void *d, size_t len)
+{
+    if ((buf->offset + len) < len)
+        abort();
+
+    if ((buf->offset + len) > buf->length) {
+        buf->length += len;
+        buf->data = kore_realloc(buf->data, buf->length);
+    }
+
+    if (len > 0)
+        memcpy(buf->data + buf->offset, d, len);
+    buf->offset += len;
+}
+
+void
+kore_buf_appendv(struct kore_buf *buf, const char *fmt, va_list args)
+{
+    int     l;
+    va_list copy;
+    char    *b, sb[2048];
+
+    va_copy(copy, args);
+
+    l = vsnprintf(sb, sizeof(sb), fmt, args);
+    if (l == -1)
+        abort();
+
+    if ((size_t)l >= sizeof(sb)) {
+        if ((l = vasprintf(&b, fmt, copy)) == -1)
+            abort();
+        kore_buf_append(buf, b, l);
+        free(b);
+    } else {
+        kore_buf_append(buf, sb, l);
+    }
+
+    va_end(copy);
+}
+
+void
+kore_buf_appendf(struct kore_buf *buf, const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    kore_buf_appendv(buf, fmt, args);
+    va_end(args);
+}
+
+u_int8_t *
+kore_buf_release(struct kore_buf *buf, size_t *len)
+{
+    u_int8_t    *p;
+
+    p = buf->data;
+    *len = buf->offset;
+
+    buf->data = NULL;
+    kore_buf_cleanup(buf);
+
+    return (p);
+}
+
+char *
+kore_buf_stringify(struct kore_buf *buf, size_t *len)
+{
+    char    c;
+
+    if (len != NULL)
+        *len = buf->offset;
+
+    c = '\0';
+    kore_buf_append(buf, &c, sizeof(c));
+    buf->offset--;
+
+    return ((char *)buf->data);
+}
+
+void
+kore_buf_replace_string(struct kore_buf *b, const char *src, void *dst,
+    size_t len)
+{
+    char        *key, *end, *tmp, *p;
+    size_t      blen, off2, nlen, klen;
+    ptrdiff_t   off;
+
+    off = 0;
+    klen = strlen(src);
+    for (;;) {
+        blen = b->offset;
+        nlen = blen + len;
+        p = (char *)b->data;
+
+        key = memmem(p + off, b->offset - off, src, klen);
+        if (key == NULL)
+            break;
+
+        end = key + klen;
+        off = key - p;
+        off2 = ((char *)(b->data + b->offset) - end);
+
+        tmp = kore_malloc(nlen);
+        memcpy(tmp, p, off);
+        if (dst != NULL)
+            memcpy((tmp + off), dst, len);
+        memcpy((tmp + off + len), end, off2);
+
+        kore_free(b->data);
+        b->data = (u_int8_t *)tmp;
+        b->offset = off + len + off2;
+        b->length = nlen;
+
+        off = off + len;
+    }
+}
+
+void
+kore_json_init(struct kore_json *json, const void *data, size_t len)
+{
+    memset(json, 0, sizeof(*json));
+
+    json->data = data;
+    json->length = len;
+
+    kore_buf_init(&json->tmpbuf, 1024);
+}
+
+int
+kore_json_parse(struct kore_json *json)
+{
+    if (json->root != NULL)
+        return (KORE_RESULT_OK);
+
+    json_errno = KORE_JSON_ERR_NONE;
+
+    if (json_peek(json) == -1) {
+        json_errno = KORE_JSON_ERR_EOF;
+        return (KORE_RESULT_ERROR);
+    }
+
+    json->root = json_item(NULL, NULL, 0);
+    if (!json_value(json, json->root, NULL)) {
+        kore_json_item_free(json->root);
+        json->root = NULL;
+        return (KORE_RESULT_ERROR);
+    }
+
+    if (json_peek(json) != -1) {
+        kore_json_item_free(json->root);
+        json->root = NULL;
+        json_errno = KORE_JSON_ERR_INVALID_JSON;
+        return (KORE_RESULT_ERROR);
+    }
+
+    return (KORE_RESULT_OK);
+}
+
+void
+kore_json_cleanup(struct kore_json *json)
+{
+    if (json == NULL)
+        return;
+
+    kore_buf_cleanup(&json->tmpbuf);
+    kore_json_item_free(json->root);
+    json->root = NULL;
+}
+
+int
+kore_json_errno(void)
+{
+    return (json_errno);
+}
+
+const char *
+kore_json_strerror(void)
+{
+    if (json_errno >= 0 && json_errno < KORE_JSON_ERR_LAST)
+        return (json_errtab[json_errno]);
+
+    return ("unknown JSON error");
+}
+
+struct kore_json_item *
+kore_json_find(struct kore_json_item *root, const char *path, u_int32_t type)
+{
+    struct kore_json_item   *item;
+    char                    *copy;
+    char                    *tokens[KORE_JSON_DEPTH_MAX + 1];
+    int                     idx, cnt;
+
+    item = root;
+    copy = kore_strdup(path);
+
+    if (!(cnt = kore_split_string(copy, "/", tokens, KORE_JSON_DEPTH_MAX))) {
+        item = NULL;
+        json_errno = KORE_JSON_ERR_INVALID_SEARCH;
+        goto out;
+    }
+
+    for (idx = 0; idx < cnt; idx++) {
+        if (item->type != KORE_JSON_TYPE_OBJECT) {
+            item = NULL;
+            break;
+        }
+
+        TAILQ_FOREACH(item, &item->data.items, list) {
+            if (item->name != NULL && !strcmp(item->name, tokens[idx]))
+                break;
+        }
+
+        if (item == NULL)
+            break;
+    }
+
+    if (item == NULL) {
+        json_errno = KORE_JSON_ERR_NOT_FOUND;
+        goto out;
+    }
+
+    if (item->type != type) {
+        json_errno = KORE_JSON_ERR_TYPE_MISMATCH;
+        item = NULL;
+        goto out;
+    }
+
+    json_errno = KORE_JSON_ERR_NONE;
+
+out:
+    kore_free(copy);
+    return (item);
+}
+
+struct kore_json_item *
+kore_json_create_item(struct kore_json_item *parent, const char *name,
+    u_int32_t type, ...)
+{
+    struct kore_json_item   *item;
+    va_list                 args;
+
+    item = json_item(parent, name, type);
+
+    va_start(args, type);
+    switch (type) {
+        case KORE_JSON_TYPE_OBJECT:
+        case KORE_JSON_TYPE_ARRAY:
+            break;
+        case KORE_JSON_TYPE_STRING:
+            item->data.string = kore_strdup(va_arg(args, const char *));
+            break;
+        case KORE_JSON_TYPE_NUMBER:
+            item->data.number = va_arg(args, double);
+            break;
+        case KORE_JSON_TYPE_INTEGER:
+            item->data.integer = va_arg(args, int64_t);
+            break;
+        case KORE_JSON_TYPE_INTEGER_U64:
+            item->data.u64 = va_arg(args, u_int64_t);
+            break;
+        case KORE_JSON_TYPE_LITERAL:
+            item->data.literal = va_arg(args, int);
+            break;
+        default:
+            abort();
+    }
+    va_end(args);
+
+    return (item);
+}
+
+void
+kore_json_item_attach(struct kore_json_item *parent, struct kore_json_item *item)
+{
+    item->parent = parent;
+    TAILQ_INSERT_TAIL(&parent->data.items, item, list);
+}
+
+void
+kore_json_item_free(struct kore_json_item *item)
+{
+    struct kore_json_item   *node;
+
+    if (item == NULL)
+        return;
+
+    switch (item->type) {
+        case KORE_JSON_TYPE_OBJECT:
+        case KORE_JSON_TYPE_ARRAY:
+            while ((node = TAILQ_FIRST(&item->data.items)) != NULL) {
+                TAILQ_REMOVE(&item->data.items, node, list);
+                kore_json_item_free(node);
+            }
+            break;
+        case KORE_JSON_TYPE_STRING:
+            kore_free(item->data.string);
+            break;
+    }
+
+    kore_free(item->name);
+    kore_free(item);
+}
+
+void
+kore_json_item_tobuf(struct kore_json_item *item, struct kore_buf *buf)
+{
+    struct kore_json_item   *nitem;
+
+    if (item->name != NULL) {
+        json_string_tobuf(item->name, buf);
+        kore_buf_append(buf, ":", 1);
+    }
+
+    switch (item->type) {
+        case KORE_JSON_TYPE_OBJECT:
+        case KORE_JSON_TYPE_ARRAY:
+            kore_buf_append(buf,
+                item->type == KORE_JSON_TYPE_OBJECT ? "{" : "[", 1);
+            TAILQ_FOREACH(nitem, &item->data.items, list) {
+                kore_json_item_tobuf(nitem, buf);
+                if (TAILQ_NEXT(nitem, list) != NULL)
+                    kore_buf_append(buf, ",", 1);
+            }
+            kore_buf_append(buf,
+                item->type == KORE_JSON_TYPE_OBJECT ? "}" : "]", 1);
+            break;
+        case KORE_JSON_TYPE_STRING:
+            json_string_tobuf(item->data.string, buf);
+            break;
+        case KORE_JSON_TYPE_NUMBER:
+            kore_buf_appendf(buf, "%f", item->data.number);
+            break;
+        case KORE_JSON_TYPE_INTEGER:
+            kore_buf_appendf(buf, "%" PRId64, item->data.integer);
+            break;
+        case KORE_JSON_TYPE_INTEGER_U64:
+            kore_buf_appendf(buf, "%" PRIu64, item->data.u64);
+            break;
+        case KORE_JSON_TYPE_LITERAL:
+            switch (item->data.literal) {
+                case KORE_JSON_TRUE:
+                    kore_buf_append(buf, "true", 4);
+                    break;
+                case KORE_JSON_FALSE:
+                    kore_buf_append(buf, "false", 5);
+                    break;
+                default:
+                    kore_buf_append(buf, "null", 4);
+                    break;
+            }
+            break;
+    }
+}
+
+struct kore_runtime_call *
+kore_runtime_getcall(const char *symbol)
+{
+    static struct kore_runtime  native = { 0 };
+    struct kore_runtime_call    *rcall;
+    void                        *ptr;
+
+    if ((ptr = dlsym(RTLD_DEFAULT, symbol)) == NULL)
+        return (NULL);
+
+    rcall = kore_malloc(sizeof(*rcall));
+    rcall->addr = ptr;
+    rcall->runtime = &native;
+
+    return (rcall);
+}
+
+int
+json_peek(struct kore_json *json)
+{
+    while (json->offset < json->length &&
+            isspace(json->data[json->offset]))
+        json->offset++;
+
+    if (json->offset >= json->length)
+        return (-1);
+
+    return (json->data[json->offset]);
+}
+
+int
+json_value(struct kore_json *json, struct kore_json_item *item, const char *name)
+{
+    struct kore_json_item   *child;
+    char                    *key;
+    int                     ch;
+
+    if (name != NULL)
+        item->name = kore_strdup(name);
+
+    switch ((ch = json_peek(json))) {
+        case '{':
+        case '[':
+            if (++json->depth > KORE_JSON_DEPTH_MAX) {
+                json_errno = KORE_JSON_ERR_DEPTH;
+                return (KORE_RESULT_ERROR);
+            }
+
+            item->type = (ch == '{') ? KORE_JSON_TYPE_OBJECT : KORE_JSON_TYPE_ARRAY;
+            TAILQ_INIT(&item->data.items);
+            json->offset++;
+
+            if (json_peek(json) == (ch == '{' ? '}' : ']')) {
+                json->offset++;
+                json->depth--;
+                return (KORE_RESULT_OK);
+            }
+
+            for (;;) {
+                key = NULL;
+                if (ch == '{') {
+                    if (json_peek(json) != '"' || !json_string(json, &key) ||
+                            json_peek(json) != ':') {
+                        kore_free(key);
+                        json_errno = KORE_JSON_ERR_INVALID_OBJECT;
+                        return (KORE_RESULT_ERROR);
+                    }
+                    json->offset++;
+                }
+
+                child = json_item(item, NULL, 0);
+                if (!json_value(json, child, key)) {
+                    kore_free(key);
+                    return (KORE_RESULT_ERROR);
+                }
+                kore_free(key);
+
+                switch (json_peek(json)) {
+                    case ',':
+                        json->offset++;
+                        continue;
+                    case '}':
+                    case ']':
+                        if (json->data[json->offset] != (ch == '{' ? '}' : ']'))
+                            break;
+                        json->offset++;
+                        json->depth--;
+                        return (KORE_RESULT_OK);
+                }
+
+                json_errno = (ch == '{') ?
+                    KORE_JSON_ERR_INVALID_OBJECT : KORE_JSON_ERR_INVALID_ARRAY;
+                return (KORE_RESULT_ERROR);
+            }
+
+        case '"':
+            item->type = KORE_JSON_TYPE_STRING;
+            return (json_string(json, &item->data.string));
+
+        case 't':
+        case 'f':
+        case 'n':
+            return (json_literal(json, item));
+
+        case -1:
+            json_errno = KORE_JSON_ERR_EOF;
+            return (KORE_RESULT_ERROR);
+
+        default:
+            return (json_number(json, item));
+    }
+}
+
+int
+json_string(struct kore_json *json, char **out)
+{
+    struct kore_buf *buf = &json->tmpbuf;
+    unsigned int    cp;
+    u_int8_t        ch, utf[4];
+    char            hex[5];
+
+    kore_buf_reset(buf);
+    json->offset++;
+
+    while (json->offset < json->length) {
+        ch = json->data[json->offset++];
+
+        if (ch == '"') {
+            *out = kore_strdup(kore_buf_stringify(buf, NULL));
+            return (KORE_RESULT_OK);
+        }
+
+        if (ch != '\\') {
+            kore_buf_append(buf, &ch, 1);
+            continue;
+        }
+
+        if (json->offset >= json->length)
+            break;
+
+        switch ((ch = json->data[json->offset++])) {
+            case 'b': ch = '\b'; break;
+            case 'f': ch = '\f'; break;
+            case 'n': ch = '\n'; break;
+            case 'r': ch = '\r'; break;
+            case 't': ch = '\t'; break;
+            case '"':
+            case '/':
+            case '\\':
+                break;
+            case 'u':
+                if (json->length - json->offset < 4)
+                    goto error;
+                memcpy(hex, &json->data[json->offset], 4);
+                hex[4] = '\0';
+                json->offset += 4;
+                cp = strtoul(hex, NULL, 16);
+                if (cp < 0x80) {
+                    utf[0] = cp;
+                    kore_buf_append(buf, utf, 1);
+                } else if (cp < 0x800) {
+                    utf[0] = 0xc0 | (cp >> 6);
+                    utf[1] = 0x80 | (cp & 0x3f);
+                    kore_buf_append(buf, utf, 2);
+                } else {
+                    utf[0] = 0xe0 | (cp >> 12);
+                    utf[1] = 0x80 | ((cp >> 6) & 0x3f);
+                    utf[2] = 0x80 | (cp & 0x3f);
+                    kore_buf_append(buf, utf, 3);
+                }
+                continue;
+            default:
+                goto error;
+        }
+
+        kore_buf_append(buf, &ch, 1);
+    }
+
+error:
+    json_errno = KORE_JSON_ERR_INVALID_STRING;
+    return (KORE_RESULT_ERROR);
+}
+
+int
+json_number(struct kore_json *json, struct kore_json_item *item)
+{
+    struct kore_buf *buf = &json->tmpbuf;
+    u_int32_t       type = KORE_JSON_TYPE_INTEGER_U64;
+    u_int8_t        ch;
+    int             err;
+
+    kore_buf_reset(buf);
+
+    while (json->offset < json->length) {
+        ch = json->data[json->offset];
+        if (ch == '-') {
+            if (type == KORE_JSON_TYPE_INTEGER_U64)
+                type = KORE_JSON_TYPE_INTEGER;
+        } else if (ch == '.' || ch == 'e' || ch == 'E' || ch == '+') {
+            type = KORE_JSON_TYPE_NUMBER;
+        } else if (!isdigit(ch)) {
+            break;
+        }
+        kore_buf_append(buf, &ch, 1);
+        json->offset++;
+    }
+
+    if (buf->offset == 0) {
+        json_errno = KORE_JSON_ERR_INVALID_JSON;
+        return (KORE_RESULT_ERROR);
+    }
+
+    kore_buf_stringify(buf, NULL);
+
+    switch (type) {
+        case KORE_JSON_TYPE_NUMBER:
+            item->data.number = kore_strtodouble((const char *)buf->data,
+                -DBL_MAX, DBL_MAX, &err);
+            break;
+        case KORE_JSON_TYPE_INTEGER:
+            item->data.integer = kore_strtonum64((const char *)buf->data, 1, &err);
+            break;
+        default:
+            item->data.u64 = (u_int64_t)kore_strtonum64((const char *)buf->data,
+                0, &err);
+            if (err == KORE_RESULT_OK && item->data.u64 <= INT64_MAX) {
+                type = KORE_JSON_TYPE_INTEGER;
+                item->data.integer = (int64_t)item->data.u64;
+            }
+            break;
+    }
+
+    if (err != KORE_RESULT_OK) {
+        json_errno = KORE_JSON_ERR_INVALID_NUMBER;
+        return (KORE_RESULT_ERROR);
+    }
+
+    item->type = type;
+    return (KORE_RESULT_OK);
+}
+
+int
+json_literal(struct kore_json *json, struct kore_json_item *item)
+{
+    static const struct {
+        const char  *str;
+        int         value;
+    } literals[] = {
+        { "true", KORE_JSON_TRUE },
+        { "false", KORE_JSON_FALSE },
+        { "null", KORE_JSON_NULL },
+    };
+    size_t  i, len;
+
+    for (i = 0; i < sizeof(literals) / sizeof(literals[0]); i++) {
+        len = strlen(literals[i].str);
+        if (json->length - json->offset >= len &&
+                !memcmp(&json->data[json->offset], literals[i].str, len)) {
+            json->offset += len;
+            item->type = KORE_JSON_TYPE_LITERAL;
+            item->data.literal = literals[i].value;
+            return (KORE_RESULT_OK);
+        }
+    }
+
+    json_errno = KORE_JSON_ERR_INVALID_LITERAL;
+    return (KORE_RESULT_ERROR);
+}
+
+struct kore_json_item *
+json_item(struct kore_json_item *parent, const char *name, u_int32_t type)
+{
+    struct kore_json_item   *item;
+
+    item = kore_calloc(1, sizeof(*item));
+    item->type = type;
+
+    if (name != NULL)
+        item->name = kore_strdup(name);
+
+    if (type == KORE_JSON_TYPE_OBJECT || type == KORE_JSON_TYPE_ARRAY)
+        TAILQ_INIT(&item->data.items);
+
+    if (parent != NULL)
+        kore_json_item_attach(parent, item);
+
+    return (item);
+}
+
+void
+json_string_tobuf(const char *str, struct kore_buf *buf)
+{
+    const char  *p;
+
+    kore_buf_append(buf, "\"", 1);
+    for (p = str; *p != '\0'; p++) {
+        switch (*p) {
+            case '"':  kore_buf_append(buf, "\\\"", 2); break;
+            case '\\': kore_buf_append(buf, "\\\\", 2); break;
+            case '\n': kore_buf_append(buf, "\\n", 2); break;
+            case '\t': kore_buf_append(buf, "\\t", 2); break;
+            case '\r': kore_buf_append(buf, "\\r", 2); break;
+            default:   kore_buf_append(buf, p, 1); break;
+        }
+    }
+    kore_buf_append(buf, "\"", 1);
+}
+
+void
+http_response(struct http_request *req, int status, const void *d, size_t len)
+{
+    char    hdr[128];
+    int     l;
+
+    req->status = status;
+    req->flags |= HTTP_REQUEST_COMPLETE;
+
+    l = snprintf(hdr, sizeof(hdr), "HTTP/1.1 %d\r\n", status);
+    net_send_queue(req->owner, hdr, l);
+    if (req->headers.offset > 0)
+        net_send_queue(req->owner, req->headers.data, req->headers.offset);
+
+    if (!(req->flags & HTTP_REQUEST_NO_CONTENT_LENGTH)) {
+        l = snprintf(hdr, sizeof(hdr), "content-length: %zu\r\n", len);
+        net_send_queue(req->owner, hdr, l);
+    }
+
+    net_send_queue(req->owner, "\r\n", 2);
+    if (d != NULL && req->method != HTTP_METHOD_HEAD)
+        net_send_queue(req->owner, d, len);
+}
+
+void
+http_response_header(struct http_request *req, const char *header, const char *value)
+{
+    if (req->headers.data == NULL)
+        kore_buf_init(&req->headers, 128);
+
+    kore_buf_appendf(&req->headers, "%s: %s\r\n", header, value);
+}
+
+int
+http_request_header(struct http_request *req, const char *header, const char *out[])
+{
+    (void)req;
+    (void)header;
+    (void)out;
+
+    return (KORE_RESULT_ERROR);
+}
+
+void
+net_send_queue(struct connection *c, const void *data, size_t len)
+{
+    if (c->fd != -1 && write(c->fd, data, len) != (ssize_t)len)
+        c->fd = -1;
+
+    c->sent += len;
+}
+
+/*
+ * Writes 'data' right away like net_send_queue(), but keeps a netbuf for
+ * it whose callback only runs on the next net_send_flush(), in order, as
+ * kore runs it once the data is sent.
+ */
+void
+net_send_stream(struct connection *c, void *data, size_t len,
+    int (*cb)(struct netbuf *), struct netbuf **out)
+{
+    struct netbuf   *nb, **last;
+
+    net_send_queue(c, data, len);
+
+    nb = kore_calloc(1, sizeof(*nb));
+    nb->buf = data;
+    nb->b_len = len;
+    nb->flags = NETBUF_IS_STREAM;
+    nb->cb = cb;
+
+    for (last = &c->streams; *last != NULL; last = &(*last)->next)
+        ;
+    *last = nb;
+
+    if (out != NULL)
+        *out = nb;
+}
+
+int
+net_send_flush(struct connection *c)
+{
+    net_release(c);
+    return (c->fd == -1 ? KORE_RESULT_ERROR : KORE_RESULT_OK);
+}
+
+void
+kore_connection_disconnect(struct connection *c)
+{
+    c->fd = -1;
+    net_release(c);
+}
+
+void
+net_release(struct connection *c)
+{
+    struct netbuf   *nb;
+
+    while ((nb = c->streams) != NULL) {
+        c->streams = nb->next;
+        if (nb->cb != NULL)
+            (void)nb->cb(nb);
+        kore_free(nb);
+    }
+}
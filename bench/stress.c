@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2021 Miguel Rodrigues <miguelangelorodrigues@enta.pt>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Renders a long list section with Mustach_With_ParallelSections again and
+ * again and compares every output with the same template rendered in
+ * sequence, after make stress:
+ *
+ *      bench/stress [-n items] [-r rounds] [-t threads]
+ *
+ * The rows print objects and arrays shared by the whole list, enter them
+ * and look members up through them, so chunks on different threads read
+ * the same items at the same time. The exit status is 1 if any parallel
+ * render differs. Best run on a machine with several cores, or built with
+ * -fsanitize=thread.
+ */
+
+#include <ctype.h>
+#include <unistd.h>
+
+#include <kore/kore.h>
+
+#include "kore_mustach.h"
+
+#define STRESS_ITEMS    20000
+#define STRESS_ROUNDS   50
+#define STRESS_THREADS  4
+
+static const char *stress_template =
+    "{{#rows}}{{meta}} {{tags}} {{.}} {{#meta}}{{id}}:{{name}}{{/meta}} "
+    "{{meta.name}} {{#tags}}[{{.}}]{{/tags}} {{#row}}{{on}}{{/row}} "
+    "{{#shout}}{{meta.name}}{{/shout}}\n{{/rows}}";
+
+void    shout(struct kore_mustach_ctx *, struct kore_buf *, size_t);
+
+static void                     usage(void);
+static struct kore_json_item    *stress_data(int);
+
+int
+main(int argc, char **argv)
+{
+    struct kore_mustach_template    *seq, *par;
+    struct kore_json_item           *root;
+    struct kore_buf                 *expected, *result;
+    int                             ch, i, items, rounds, threads, failed;
+
+    items = STRESS_ITEMS;
+    rounds = STRESS_ROUNDS;
+    threads = STRESS_THREADS;
+
+    while ((ch = getopt(argc, argv, "hn:r:t:")) != -1) {
+        switch (ch) {
+            case 'n':
+                items = atoi(optarg);
+                break;
+            case 'r':
+                rounds = atoi(optarg);
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            default:
+                usage();
+        }
+    }
+
+    if (items <= 0 || rounds <= 0 || threads <= 0)
+        usage();
+
+    kore_mustach_register_lambda_inplace("shout", shout);
+    kore_mustach_parallel(100, threads);
+
+    root = stress_data(items);
+    seq = kore_mustach_compile(stress_template, Mustach_With_AllExtensions);
+    par = kore_mustach_compile(stress_template,
+        Mustach_With_AllExtensions | Mustach_With_ParallelSections);
+
+    if (seq == NULL || par == NULL || !kore_mustach_render(seq, root, &expected)) {
+        fprintf(stderr, "stress: %s\n", kore_mustach_strerror());
+        return (1);
+    }
+
+    for (i = 0, failed = 0; i < rounds; i++) {
+        if (!kore_mustach_render(par, root, &result)) {
+            printf("round %d FAIL error: %s\n", i, kore_mustach_strerror());
+            failed++;
+            continue;
+        }
+
+        if (result->offset != expected->offset ||
+                memcmp(result->data, expected->data, result->offset)) {
+            printf("round %d FAIL %zu bytes, %zu in sequence\n", i,
+                result->offset, expected->offset);
+            failed++;
+        }
+        kore_buf_free(result);
+    }
+
+    printf("%d items, %d rounds on %d threads: %d failed\n", items, rounds,
+        threads, failed);
+
+    kore_buf_free(expected);
+    kore_mustach_template_free(seq);
+    kore_mustach_template_free(par);
+    kore_json_item_free(root);
+
+    return (failed ? 1 : 0);
+}
+
+void
+usage(void)
+{
+    fprintf(stderr, "usage: stress [-n items] [-r rounds] [-t threads]\n");
+    exit(1);
+}
+
+void
+shout(struct kore_mustach_ctx *ctx, struct kore_buf *b, size_t off)
+{
+    size_t  i;
+
+    (void)ctx;
+
+    for (i = off; i < b->offset; i++)
+        b->data[i] = toupper(b->data[i]);
+}
+
+/* A list of 'items' rows, next to an object and an array they all use. */
+struct kore_json_item *
+stress_data(int items)
+{
+    struct kore_json_item   *root, *meta, *tags, *rows, *row;
+    int                     i;
+
+    root = kore_json_create_object(NULL, NULL);
+    kore_json_create_string(root, "shout", "(=>)");
+
+    meta = kore_json_create_object(root, "meta");
+    kore_json_create_integer(meta, "id", 42);
+    kore_json_create_string(meta, "name", "shared <meta>");
+
+    tags = kore_json_create_array(root, "tags");
+    kore_json_create_string(tags, NULL, "a");
+    kore_json_create_string(tags, NULL, "b");
+
+    rows = kore_json_create_array(root, "rows");
+    for (i = 0; i < items; i++) {
+        row = kore_json_create_object(rows, NULL);
+        kore_json_create_integer(row, "i", i);
+        kore_json_create_literal(kore_json_create_object(row, "row"), "on",
+            i % 2 ? KORE_JSON_TRUE : KORE_JSON_FALSE);
+    }
+
+    return (root);
+}
@@ -2,8 +2,7 @@
 #include <math.h>
 #include <kore/kore.h>
 #include <kore/http.h>
-#include <mustach/mustach.h>
-#include <mustach/kore_mustach.h>
+#include <kore_mustach.h>
 
 #if defined(__linux__)
 #include <kore/seccomp.h>
@@ -16,12 +15,14 @@ KORE_SECCOMP_FILTER("app", KORE_SYSCALL_ALLOW(newfstatat))
 
 double eval(const char *);
 
+void kore_parent_configure(int, char **);
+
 int hello(struct http_request *);
 int handler(struct http_request *);
 
-void upper(struct kore_buf *);
-void lower(struct kore_buf *);
-void bold(struct kore_buf *);
+void upper(struct kore_mustach_ctx *, struct kore_buf *, size_t);
+void lower(struct kore_mustach_ctx *, struct kore_buf *, size_t);
+void bold(struct kore_mustach_ctx *, struct kore_buf *, size_t);
 void taxed_value(struct kore_buf *);
 void tinyexpr(struct kore_buf *);
 
@@ -38,6 +39,16 @@ static struct {
     {'6', asset_test6_must, asset_test6_json},
 };
 
+void
+kore_parent_configure(int argc, char **argv)
+{
+    kore_mustach_register_lambda_inplace("upper", upper);
+    kore_mustach_register_lambda_inplace("lower", lower);
+    kore_mustach_register_lambda_inplace("bold", bold);
+    kore_mustach_register_lambda("taxed_value", taxed_value);
+    kore_mustach_register_lambda("tinyexpr", tinyexpr);
+}
+
 int
 handler(struct http_request *req)
 {
@@ -64,7 +75,6 @@ handler(struct http_request *req)
 int
 hello(struct http_request *req)
 {
-    struct kore_buf *result = NULL;
     struct kore_json_item *item = kore_json_create_object(NULL, NULL);
 
     kore_json_create_string(item, "hello", "hello world");
@@ -76,30 +86,27 @@ hello(struct http_request *req)
     kore_json_create_string(item, "tinyexpr", "(=>)");
 
     http_response_header(req, "content-type", "text/html");
-    if (!kore_mustach_json((const char *)asset_hello_html, item, Mustach_With_AllExtensions, &result)) {
+    if (!kore_mustach_http_cached(req, 200, (const char *)asset_hello_html, item, Mustach_With_AllExtensions)) {
         kore_log(LOG_NOTICE, kore_mustach_strerror());
         http_response(req, 400, kore_mustach_strerror(), strlen(kore_mustach_strerror()));
-    } else {
-        http_response(req, 200, result->data, result->offset);
-        kore_buf_free(result);
     }
 
     kore_json_item_free(item);
     return (KORE_RESULT_OK);
 }
 
-void upper(struct kore_buf *b)
+void upper(struct kore_mustach_ctx *ctx, struct kore_buf *b, size_t off)
 {
     uint8_t *c, *end = b->data + b->offset;
 
-    for (c = b->data; c < end; c++) *c = toupper(*c);
+    for (c = b->data + off; c < end; c++) *c = toupper(*c);
 }
 
-void lower(struct kore_buf *b)
+void lower(struct kore_mustach_ctx *ctx, struct kore_buf *b, size_t off)
 {
     uint8_t *c, *end = b->data + b->offset;
 
-    for (c = b->data; c < end; c++) *c = tolower(*c);
+    for (c = b->data + off; c < end; c++) *c = tolower(*c);
 }
 
 void taxed_value(struct kore_buf *b)
@@ -111,13 +118,14 @@ void taxed_value(struct kore_buf *b)
         kore_buf_appendf(b, "%g", o->data.integer * 0.6);
 }
 
-void bold(struct kore_buf *b)
+void bold(struct kore_mustach_ctx *ctx, struct kore_buf *b, size_t off)
 {
-    char *s = kore_strdup(kore_buf_stringify(b, NULL));
+    size_t len = b->offset - off;
 
-    kore_buf_reset(b);
-    kore_buf_appendf(b, "<b> %s </b>", s);
-    kore_free(s);
+    kore_buf_append(b, "<b> ", 4);
+    memmove(b->data + off + 4, b->data + off, len);
+    memcpy(b->data + off, "<b> ", 4);
+    kore_buf_append(b, " </b>", 5);
 }
 
 void tinyexpr(struct kore_buf *b)
@@ -15,14 +15,53 @@
  */
 
 #define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
 #include <float.h>
+#include <inttypes.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 #include <kore/kore.h>
-#include "mustach/mustach.h"
+#include <kore/http.h>
 #include "kore_mustach.h"
 
-static int mustach_errno = 0;
+#define STREAM_CHUNK    16384
+#define INDEX_MIN_ITEMS 16
+#define LAMBDA_BUCKETS  64
+#define PARTIAL_BUCKETS 64
+#define PARTIAL_CHECK   1000
+#define FRAGMENT_BUCKETS 256
+#define FRAGMENT_SIZE   (1024 * 1024)
+#define FRAGMENT_TTL    60000
+#define PARALLEL_MIN    1000
+#define PARALLEL_THREADS 4
+#define PARALLEL_CHUNKS 4       /* chunks per thread a list is cut in */
+#if defined(KORE_USE_TASKS)
+#define PARALLEL_TASKS  1
+#else
+#define PARALLEL_TASKS  0       /* kore pools are only thread safe with tasks */
+#endif
+#define SEGMENT_MIN     64      /* shorter text is copied, not pointed to */
+#define ARENA_BLOCK     16384
+#define RESULT_SIZE     1024
+#define NUMBER_MAX      32
+#define MUSTACH_MAX_DEPTH  256
+#define MUSTACH_MAX_LENGTH 1024
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ESCAPE_AVX2     1       /* picked at runtime, the build need not enable it */
+#endif
+
+#define JSON_SPACE(c)   ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r')
+
+static __thread int mustach_errno = 0;
 
 static const char *mustach_errtab[] = {
     "no error",
@@ -48,51 +87,518 @@ enum comp {
 	C_ge = 10
 };
 
+static const struct {
+    const char  *str;
+    size_t      len;
+} escapes[256] = {
+    ['&'] = { "&amp;", 5 },
+    ['<'] = { "&lt;", 4 },
+    ['>'] = { "&gt;", 4 },
+    ['"'] = { "&quot;", 6 },
+};
+
+static const char digits[] =
+    "00010203040506070809" "10111213141516171819"
+    "20212223242526272829" "30313233343536373839"
+    "40414243444546474849" "50515253545556575859"
+    "60616263646566676869" "70717273747576777879"
+    "80818283848586878889" "90919293949596979899";
+
+static const char structural[256] = {
+    ['"'] = 1, [':'] = 1, [','] = 1,
+    ['{'] = 1, ['}'] = 1, ['['] = 1, [']'] = 1,
+};
+
+/*
+ * A value handed out for output, and what gives it back once written.
+ */
+struct mustach_sbuf {
+    const char  *value;
+    void        (*releasecb)(const char *, void *);
+    void        *closure;
+    size_t      length;
+};
+
+/*
+ * Process wide cache of lambdas by name. Entries are registered with
+ * kore_mustach_register_lambda() or filled in from kore_runtime_getcall()
+ * the first time a name is looked up, including names that do not resolve
+ * so they are not looked up again.
+ */
+struct lambda {
+    char                *name;
+    u_int32_t           hash;
+    int                 resolved;
+    void                (*cb)(struct kore_buf *);
+    void                (*cb_ctx)(struct kore_mustach_ctx *, struct kore_buf *);
+    void                (*cb_inplace)(struct kore_mustach_ctx *, struct kore_buf *, size_t);
+    LIST_ENTRY(lambda)  list;
+};
+
+static LIST_HEAD(, lambda) lambdas[LAMBDA_BUCKETS];
+static pthread_rwlock_t    lambda_lock = PTHREAD_RWLOCK_INITIALIZER;
+
 struct stack {
-    struct kore_json_item       *root;
+    void                        *root;
+    void                        *list;      /* list or object iterated */
     int                         iterate;
-    struct kore_runtime_call    *rcall;
-    struct kore_buf             *buf;
+    struct lambda               *lambda;
+    struct kore_buf             *buf;       /* own output of a lambda not working in place */
+    struct kore_buf             *out;       /* output of the enclosing section */
+    size_t                      start;      /* where an in-place lambda's section begins in it */
+};
+
+struct index_entry {
+    struct kore_json_item   *parent;
+    struct kore_json_item   *item;
+    const char              *name;
+    size_t                  len;
+    u_int32_t               hash;
+};
+
+/*
+ * Bump allocator for memory that lives no longer than a render. It is
+ * reset in one go when the render is done, and kept for the next render
+ * on the same context folded into a single block.
+ */
+struct arena_block {
+    struct arena_block  *next;
+    size_t              size;
+    size_t              used;
+    u_int8_t            data[];
+};
+
+struct arena {
+    struct arena_block  *head;
+    u_int64_t           blocks;     /* allocated so far, for the stats */
+};
+
+/*
+ * Per render hash index of object members, keyed by object and member
+ * name. An object is indexed on its first lookup, objects with fewer than
+ * INDEX_MIN_ITEMS members are only marked as seen and scanned instead.
+ */
+struct index {
+    struct index_entry  *entries;
+    size_t              size;
+    size_t              count;
+    struct arena        *arena;
+};
+
+struct seg {
+    const char  *name;
+    size_t      len;
+};
+
+/*
+ * The operand of a comparison, parsed up front into each type a value
+ * may be compared as, so evaluating it in a loop parses nothing.
+ */
+struct operand {
+    const char  *str;       /* after the '!' */
+    size_t      len;
+    int         flip;       /* a leading '!' negates the comparison */
+    int         number;     /* 'd' holds the operand */
+    int         integer;    /* 'i' holds the operand */
+    int         u64;        /* 'u' holds the operand */
+    double      d;
+    int64_t     i;
+    u_int64_t   u;
+};
+
+/*
+ * A tag name as keyval() rewrites it, parsed once when the template is
+ * compiled: the path split into its segments, and the comparison or member
+ * iteration that followed it.
+ */
+struct key {
+    int             self;       /* the lone '.' */
+    int             iterate;    /* the lone '*' with Mustach_With_ObjectIter */
+    int             cache;      /* 'cache:' with Mustach_With_FragmentCache, not in the path */
+    enum comp       comp;
+    const char      *value;     /* comparison operand, or "*" */
+    struct operand  operand;    /* 'value' parsed, when 'comp' is set */
+    char            *path;
+    struct seg      *segs;
+    size_t          count;
+};
+
+/* A piece of segmented output, in 'base' or at 'offset' in the data. */
+struct span {
+    const char      *base;      /* NULL for the data */
+    size_t          offset;
+    size_t          length;
+};
+
+/*
+ * The output of kore_mustach_render_segments(). Spans are recorded as the
+ * render goes, the text it copies piling up in 'data' in between, and only
+ * turned into iovecs once 'data' no longer moves.
+ */
+struct kore_mustach_segments {
+    struct kore_buf                 *data;
+    size_t                          mark;       /* end of the data already in a span */
+    struct span                     *spans;
+    size_t                          count;
+    size_t                          size;
+    struct kore_mustach_template    **held;     /* partials the spans may point into */
+    size_t                          nheld;
+    int                             borrow;     /* spans may point into the json data too */
+    size_t                          held_size;
+    struct iovec                    *iov;
+    size_t                          length;
 };
 
 struct closure {
-    struct kore_json_item   *context;
+    void                    *context;
+    const struct kore_mustach_provider  *provider;  /* NULL for kore_json_item data */
+    void                    *arg;
     struct kore_buf         *result;
+    struct kore_buf         *out;       /* the result, or the buffer of the lambda being rendered */
+    int                     windows;    /* in-place lambda sections open */
+    struct kore_mustach_segments    *segments;  /* set for kore_mustach_render_segments() */
+    int                     held;       /* the value get() handed out lives as long as the data */
     int                     flags;
     int                     depth;
     struct stack            stack[MUSTACH_MAX_DEPTH];
+    struct kore_buf         scratch;
+    char                    number[NUMBER_MAX];     /* a number or literal handed to mustach */
+    struct index            index;
+    struct arena            arena;
+    struct kore_buf         **spare;    /* lambda buffers free for reuse */
+    size_t                  nspare;
+    size_t                  spare_size;
+    struct http_request     *req;
+    int                     status;
+    int                     streaming;
+    size_t                  chunk;
+    size_t                  presize;
+    struct kore_mustach_stats   stats;
+};
+
+enum opcode {
+    OP_TEXT = 0,
+    OP_INDENT,
+    OP_PUT,
+    OP_SECTION,
+    OP_CLOSE,
+    OP_PARTIAL,
+    OP_NONE
+};
+
+struct op {
+    enum opcode     type;
+    int             flag;       /* escape for OP_PUT, inverted for OP_SECTION and OP_CLOSE */
+    int             bol;        /* first op of a template line, used for partial indentation */
+    size_t          jump;       /* index of the matching OP_CLOSE or OP_SECTION */
+    u_int64_t       sig;        /* body signature of a cache section */
+    const char      *text;      /* literal text for OP_TEXT, indentation for OP_PARTIAL */
+    size_t          length;
+    char            *name;
+    struct key      *key;       /* parsed name for OP_PUT and OP_SECTION */
+};
+
+struct prefix {
+    const char      *text;
+    size_t          length;
+    int             depth;
+    struct prefix   *parent;
+};
+
+struct kore_mustach_template {
+    char        *text;
+    size_t      length;
+    int         flags;
+    int         refs;
+    struct op   *ops;
+    size_t      count;
+    size_t      size;
+    size_t      hint;       /* result size set by kore_mustach_template_size_hint() */
+    size_t      estimate;   /* result size learned from past renders */
+};
+
+/*
+ * A template being specialized on static data. The literal text of the
+ * residual template is gathered in 'text', its ops keep offsets into it
+ * until it is copied into the template at the end.
+ */
+struct spec {
+    struct closure                  *cl;
+    void                            *root;      /* the static data */
+    struct kore_mustach_template    *res;
+    struct kore_buf                 text;
+};
+
+/*
+ * Process wide cache of file partials by name and flags, compiled once.
+ * An entry's file is stat(2)ed again once partial_check milliseconds went
+ * by since it was last looked at, and reloaded if its mtime or size moved.
+ * A name that is not a file is kept too, without a template, so it is not
+ * stat(2)ed again before the same delay.
+ */
+struct partial {
+    char                            *name;
+    u_int32_t                       hash;
+    int                             flags;
+    struct kore_mustach_template    *tpl;      /* NULL if not a file */
+    struct timespec                 mtime;
+    off_t                           size;
+    u_int64_t                       checked;
+    LIST_ENTRY(partial)             list;
+};
+
+static LIST_HEAD(, partial) partials[PARTIAL_BUCKETS];
+static pthread_rwlock_t     partial_lock = PTHREAD_RWLOCK_INITIALIZER;
+static u_int64_t            partial_check = PARTIAL_CHECK;
+static u_int64_t            partial_generation = 0;     /* moves when a cached partial does */
+
+/*
+ * Process wide cache of the output of cache sections, by the signature of
+ * the section and the text of its key's value, and of whole renders, by
+ * the signature of the template and the data flattened. The least recently
+ * used entries go first once the outputs take more than fragment_max bytes.
+ */
+struct fragment {
+    char                    *name;      /* the key as written, for invalidation */
+    char                    *value;
+    size_t                  vlen;
+    u_int64_t               sig;
+    u_int64_t               hash;
+    u_int8_t                *data;
+    size_t                  length;
+    u_int64_t               etag;       /* hash of 'data', for whole pages */
+    u_int64_t               stored;
+    LIST_ENTRY(fragment)    list;
+    TAILQ_ENTRY(fragment)   lru;
+};
+
+static LIST_HEAD(, fragment)    fragments[FRAGMENT_BUCKETS];
+static TAILQ_HEAD(fragment_lru_head, fragment) fragment_lru = TAILQ_HEAD_INITIALIZER(fragment_lru);
+static pthread_mutex_t          fragment_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t                   fragment_bytes = 0;
+static size_t                   fragment_max = FRAGMENT_SIZE;   /* also loaded unlocked */
+static u_int64_t                fragment_ttl = FRAGMENT_TTL;
+
+/*
+ * A section over a long list rendered with Mustach_With_ParallelSections.
+ * Its items are cut in chunks that the pool threads and the render itself
+ * take in turn, each rendered on a closure of its own into a buffer of its
+ * own, which the render appends in order as they are done.
+ */
+struct parallel {
+    struct kore_mustach_template    *tpl;
+    size_t                          pc;
+    struct prefix                   *prefix;
+    struct closure                  *cl;        /* the render, read only */
+    void                            **items;
+    size_t                          count;
+    size_t                          size;       /* items per chunk */
+    size_t                          chunks;
+    size_t                          next;       /* first chunk nobody took */
+    struct kore_buf                 **out;      /* set once a chunk is done */
+    int                             *rc;
+    struct kore_mustach_stats       stats;
+    TAILQ_ENTRY(parallel)           list;
+};
+
+static TAILQ_HEAD(, parallel)   parallel_jobs = TAILQ_HEAD_INITIALIZER(parallel_jobs);
+static pthread_mutex_t          parallel_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t           parallel_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t           parallel_done = PTHREAD_COND_INITIALIZER;
+static int                      parallel_threads = 0;
+static int                      parallel_max = PARALLEL_THREADS;
+static size_t                   parallel_min = PARALLEL_MIN;
+
+/*
+ * A json document indexed for Mustach_With_LazyJson. Only the positions of
+ * its structural characters outside of strings are recorded, each '{' and
+ * '[' linked to the token closing it, so a value is skipped in one step and
+ * only decoded once a render asks for it. An item is the token its value
+ * follows: the ':' of a member, the '[' or ',' before an element, or the
+ * first token for the root.
+ */
+struct lazy_tok {
+    u_int32_t   pos;        /* offset past the character, 0 for the root */
+    u_int32_t   close;      /* token closing a '{' or '[' */
 };
 
-static struct closure *global_cl = NULL;
+struct lazy_json {
+    const char              *data;
+    size_t                  length;
+    struct lazy_tok         *toks;
+    size_t                  count;
+    size_t                  size;
+    struct kore_buf         tmp;        /* the string decoded last */
+    struct arena            arena;      /* member names handed out */
+    struct kore_json_item   *held;      /* items built for kore_mustach_find() */
+};
+
+/*
+ * A render context holds everything a render works on, renders on
+ * different contexts share nothing. The calls without one take the
+ * thread's spare_ctx, reused from one call to the next on that thread
+ * with the buffers earlier renders left in it, or a new one while the
+ * spare is in use, by a lambda rendering another template for instance.
+ */
+struct kore_mustach_ctx {
+    struct closure  cl;
+    int             error;
+};
+
+/* the render in progress on this thread, for kore_mustach_find() */
+static __thread struct closure *current = NULL;
+
+/* a context kept for the calls without one to reuse */
+static __thread struct kore_mustach_ctx *spare_ctx = NULL;
+
+/* renders taking at least this long are logged, 0 logs none */
+static u_int64_t    stats_threshold = 0;
 
 static int  start(void *);
-static int  enter(void *, const char *);
+static int  enter(void *, const struct key *);
 static int  leave(void *);
 static int  next(void *);
-static int  get(void *, const char *, struct mustach_sbuf *);
-static int  partial(void *, const char *, struct mustach_sbuf *);
+static int  get(void *, const struct key *, struct mustach_sbuf *);
+static struct kore_mustach_template *partial(void *, const char *, int, int *);
 static int  emit(void *, const char *, size_t, int, FILE *);
 
-static struct kore_json_item    *json_get_item(struct kore_json_item *, const char *);
-static struct kore_json_item    *json_item_in_stack(struct closure *, const char *);
-static void                     json_tosbuf(struct kore_json_item *, struct mustach_sbuf *);
-static int                      json_item_islambda(struct kore_json_item *);
+static int                      data_kind(struct closure *, void *);
+static void                     *data_member(struct closure *, void *, const char *, size_t);
+static void                     *data_first(struct closure *, void *);
+static void                     *data_next(struct closure *, void *, void *);
+static const char               *data_name(struct closure *, void *);
+static void                     data_tosbuf(struct closure *, void *, struct mustach_sbuf *);
+static int                      data_compare(struct closure *, void *, const struct operand *);
+static void                     *data_get(struct closure *, void *, const struct seg *, size_t);
+static void                     *data_in_stack(struct closure *, const struct seg *, size_t);
+static int                      path_split(const char *, struct seg *);
+static void                     *data_find(struct closure *, const char *);
+static struct kore_json_item    *json_find(struct closure *, const char *);
+static struct kore_json_item    *json_member(struct closure *, struct kore_json_item *, const char *, size_t);
+static void                     json_tosbuf(struct closure *, struct kore_json_item *, struct mustach_sbuf *);
+static const char               *json_scalar(struct kore_json_item *, char *, size_t *);
+static size_t                   fmt_u64(char *, u_int64_t);
+static size_t                   fmt_i64(char *, int64_t);
+static size_t                   fmt_double(char *, double);
+static int                      lazy_render(const char *, const char *, int, struct kore_buf **);
+static int                      lazy_index(struct lazy_json *, const char *, size_t);
+static void                     lazy_cleanup(struct lazy_json *);
+static void                     lazy_push(struct lazy_json *, size_t);
+static int                      lazy_blank(const char *, const char *);
+static const char               *lazy_scan(const char *, const char *);
+static const char               *lazy_scan_string(const char *, const char *);
+static char                     lazy_char(struct lazy_json *, size_t);
+static const char               *lazy_value(struct lazy_json *, size_t);
+static const char               *lazy_end(struct lazy_json *, size_t);
+static size_t                   lazy_after(struct lazy_json *, size_t);
+static int                      lazy_key(struct lazy_json *, size_t, const char **, const char **);
+static int                      lazy_string(struct lazy_json *, const char *, const char *);
+static int                      lazy_scalar(struct lazy_json *, size_t, struct kore_json_item *);
+static struct kore_json_item    *lazy_parse(struct lazy_json *, size_t);
+static struct kore_json_item    *lazy_item(struct closure *, void *);
+static int                      lazy_kind(void *, void *);
+static void                     *lazy_member(void *, void *, const char *, size_t);
+static void                     *lazy_first(void *, void *);
+static void                     *lazy_next(void *, void *, void *);
+static const char               *lazy_name(void *, void *);
+static void                     lazy_tostring(void *, void *, struct kore_buf *);
+static int                      lazy_compare(struct lazy_json *, void *, const struct operand *);
 static void                     keyval(char *, char **, enum comp *, int);
-static int                      compare(struct kore_json_item *, const char *);
-static int                      evalcomp(struct kore_json_item *, const char *, enum comp);
-static int                      islambda(struct closure *);
-static void                     partial_tosbuf(const char *, struct mustach_sbuf *);
-static void                     releasecb(const char *, void *);
-static void                     mustach_runtime_execute(void *, struct kore_buf *);
-
-static const struct mustach_itf itf = {
-    .start = start,
-    .enter = enter,
-    .next = next,
-    .leave = leave,
-    .partial = partial,
-    .get = get,
-    .emit = emit
+static void                     pointer_unescape(char *);
+static struct key               *key_parse(const char *, int);
+static void                     operand_parse(struct operand *, const char *);
+static int                      compare(struct kore_json_item *, const struct operand *);
+static int                      evalcomp(struct closure *, void *, const struct operand *, enum comp);
+static int                      stream_flush(struct closure *, int);
+static void                     escape_append(struct kore_buf *, const char *, size_t);
+static const char               *escape_scan(const char *, const char *);
+#if defined(ESCAPE_AVX2)
+static const char               *escape_scan_avx2(const char *, const char *)
+                                    __attribute__((target("avx2")));
+#endif
+static struct kore_mustach_template *partial_file(const char *, int, int, int *);
+static struct kore_mustach_template *partial_update(const char *, int, u_int64_t, int *);
+static struct kore_mustach_template *partial_read(const char *, int, struct stat *, int *);
+static struct partial           *partial_entry(const char *, int);
+static struct partial           *partial_insert(const char *, int);
+static void                     partial_drop(struct partial *);
+static void                     partial_remove(struct partial *);
+static int                      fragment_exec(struct kore_mustach_template *, struct closure *, size_t, struct prefix *);
+static int                      fragment_get(struct kore_buf *, const char *, size_t, u_int64_t, u_int64_t, u_int64_t *);
+static void                     fragment_put(const char *, const char *, size_t, u_int64_t, const void *, size_t, u_int64_t, u_int64_t);
+static struct fragment          *fragment_entry(const char *, size_t, u_int64_t, u_int64_t);
+static void                     fragment_remove(struct fragment *);
+static void                     fragment_trim(size_t);
+static u_int64_t                fragment_hash(u_int64_t, const void *, size_t);
+static u_int64_t                output_key(const char *, int, struct kore_json_item *, struct kore_buf *);
+static int                      output_render(const char *, struct kore_json_item *, int, struct kore_buf *, u_int64_t, struct kore_buf **, u_int64_t *);
+static void                     json_flatten(struct kore_buf *, struct kore_json_item *);
+static void                     etag_format(char *, u_int64_t);
+static int                      etag_match(const char *, const char *);
+static int                      parallel_exec(struct kore_mustach_template *, struct closure *, size_t, struct prefix *);
+static size_t                   parallel_take(struct parallel *);
+static void                     parallel_chunk(struct parallel *, size_t, struct closure *);
+static void                     parallel_start(void);
+static void                     *parallel_main(void *);
+static u_int32_t                index_hash(struct kore_json_item *, const char *, size_t);
+static struct index_entry       *index_slot(struct index *, struct kore_json_item *, const char *, size_t, u_int32_t);
+static void                     index_grow(struct index *);
+static void                     index_insert(struct index *, struct kore_json_item *, const char *, size_t, struct kore_json_item *);
+static void                     index_object(struct index *, struct kore_json_item *);
+static void                     index_cleanup(struct index *);
+static void                     *arena_calloc(struct arena *, size_t, size_t);
+static void                     arena_reset(struct arena *);
+static void                     arena_free(struct arena *);
+static struct kore_buf          *buf_get(struct closure *);
+static void                     buf_put(struct closure *, struct kore_buf *);
+static void                     buf_reserve(struct kore_buf *, size_t);
+static void                     closure_init(struct closure *, void *, int);
+static int                      ctx_render(struct kore_mustach_ctx *, struct kore_mustach_template *, struct kore_buf **);
+static struct kore_mustach_ctx  *ctx_get(void);
+static void                     ctx_put(struct kore_mustach_ctx *);
+static struct lambda            *lambda_entry(const char *, int);
+static struct lambda            *lambda_find(const char *);
+static void                     lambda_call(struct lambda *, struct closure *, struct kore_buf *, size_t);
+static const char               *error_string(int);
+
+static struct kore_mustach_template *template_compile(const char *, size_t, int, int *);
+static int                      template_tokenize(struct kore_mustach_template *);
+static void                     template_text(struct kore_mustach_template *, const char *, size_t);
+static struct op                *template_op(struct kore_mustach_template *, enum opcode, const char *, size_t);
+static void                     template_standalone(struct kore_mustach_template *);
+static int                      template_link(struct kore_mustach_template *);
+static int                      template_render(struct kore_mustach_template *, struct closure *);
+static void                     template_stats(struct closure *, u_int64_t);
+static size_t                   template_presize(struct kore_mustach_template *);
+static void                     template_learn(struct kore_mustach_template *, size_t);
+static struct kore_mustach_template *template_ref(struct kore_mustach_template *);
+static void                     template_release(struct kore_mustach_template *);
+static void                     template_sign(struct kore_mustach_template *);
+static int                      template_exec(struct kore_mustach_template *, struct closure *, size_t, size_t, struct prefix *);
+static int                      spec_exec(struct spec *, struct kore_mustach_template *, size_t, size_t, struct prefix *, int);
+static int                      spec_put(struct spec *, struct op *, int);
+static int                      spec_section(struct spec *, struct kore_mustach_template *, size_t, struct prefix *, int);
+static int                      spec_partial(struct spec *, struct op *, struct prefix *, int);
+static void                     *spec_lookup(struct spec *, const struct seg *, size_t, int);
+static size_t                   spec_op(struct spec *, struct op *);
+static void                     spec_text(struct spec *, const char *, size_t, int);
+static void                     spec_literal(struct spec *, size_t);
+static void                     spec_prefix(struct spec *, struct prefix *);
+static int                      prefix_emit(struct closure *, struct prefix *);
+static int                      emit_held(struct closure *, const char *, size_t, int);
+static void                     segments_span(struct kore_mustach_segments *, size_t, const char *, size_t);
+static void                     segments_close(struct kore_mustach_segments *, size_t);
+static void                     segments_add(struct kore_mustach_segments *, const char *, size_t, size_t);
+static void                     segments_hold(struct kore_mustach_segments *, struct kore_mustach_template *);
+static void                     segments_finish(struct kore_mustach_segments *);
+static int                      segments_render(struct kore_mustach_template *,
+                                    struct kore_json_item *, int, struct kore_mustach_segments **);
+static int                      segments_sent(struct netbuf *);
+static size_t                   sbuf_length(struct mustach_sbuf *);
+static void                     sbuf_release(struct mustach_sbuf *);
+
+static const struct kore_mustach_provider lazy_provider = {
+    lazy_kind, lazy_member, lazy_first, lazy_next, lazy_name, lazy_tostring, NULL
 };
 
 int
@@ -100,9 +606,19 @@ start(void *closure)
 {
     struct closure *cl = closure;
 
-    mustach_errno = 0;
+    if (cl->result == NULL) {
+        cl->result = kore_buf_alloc(cl->presize);
+        cl->stats.allocs++;
+    } else if (cl->result->length - cl->result->offset < cl->presize) {
+        /* a batch appending to one result */
+        buf_reserve(cl->result, cl->presize);
+        cl->stats.allocs++;
+    }
 
-    cl->result = kore_buf_alloc(1024);
+    cl->out = cl->result;
+    cl->windows = 0;
+    if (cl->scratch.data == NULL)
+        kore_buf_init(&cl->scratch, 64);
     cl->depth = 0;
     cl->stack[cl->depth] = (struct stack){};
     cl->stack[cl->depth].root = cl->context;
@@ -110,38 +626,39 @@ start(void *closure)
     if (cl->flags & Mustach_With_Compare)
         cl->flags |= Mustach_With_Equal;
 
-    /* json root must be an object, otherwise there might undefined behavior */
-    if (cl->context != NULL && cl->context->type != KORE_JSON_TYPE_OBJECT)
+    /* the root must be an object, otherwise there might undefined behavior */
+    if (cl->context != NULL && data_kind(cl, cl->context) != KORE_MUSTACH_OBJECT)
         return (MUSTACH_ERROR_INVALID_ITF);
 
     return (MUSTACH_OK);
 }
 
 int
-enter(void *closure, const char *name)
+enter(void *closure, const struct key *key)
 {
     struct closure              *cl = closure;
-    struct kore_runtime_call    *rcall;
-    struct kore_json_item       *item, *n;
-    enum comp                   k;
-    char                        key[MUSTACH_MAX_LENGTH + 1], *val;
+    struct lambda               *lambda;
+    void                        *item, *n;
+    const char                  *val = key->value;
+    enum comp                   k = key->comp;
+    int                         kind;
 
     if (cl->context == NULL)
         return (0);
 
-    if ((size_t)++cl->depth >= sizeof(cl->stack) / sizeof(cl->stack[0]))
+    if ((size_t)cl->depth + 1 >= sizeof(cl->stack) / sizeof(cl->stack[0]))
         return (MUSTACH_ERROR_TOO_DEEP);
 
+    cl->depth++;
     cl->stack[cl->depth] = (struct stack){};
     cl->stack[cl->depth].root = cl->context;
 
-    if (name[0] == '*' && name[1] == '\0' &&
-            (cl->flags & Mustach_With_ObjectIter)) {
-
-        if (cl->context->type == KORE_JSON_TYPE_OBJECT &&
-                (n = TAILQ_FIRST(&cl->context->data.items)) != NULL) {
-            cl->context = n;
+    if (key->iterate) {
+        if (data_kind(cl, cl->context) == KORE_MUSTACH_OBJECT &&
+                (n = data_first(cl, cl->context)) != NULL) {
+            cl->stack[cl->depth].list = cl->context;
             cl->stack[cl->depth].iterate = 1;
+            cl->context = n;
             return (1);
         }
 
@@ -149,41 +666,48 @@ enter(void *closure, const char *name)
         return (0);
     }
 
-    kore_strlcpy(key, name, sizeof(key));
-    keyval(key, &val, &k, cl->flags);
-    item = json_item_in_stack(cl, key);
+    item = data_in_stack(cl, key->segs, key->count);
 
     if (item != NULL) {
-        n = TAILQ_FIRST(&item->data.items);
-        switch (item->type) {
-            case KORE_JSON_TYPE_LITERAL:
-                if (item->data.literal == KORE_JSON_TRUE)
-                    return (1);
+        switch ((kind = data_kind(cl, item))) {
+            case KORE_MUSTACH_FALSE:
                 break;
 
-            case KORE_JSON_TYPE_ARRAY:
-                if (n != NULL) {
-                    cl->context = n;
+            case KORE_MUSTACH_TRUE:
+                return (1);
+
+            case KORE_MUSTACH_LIST:
+                if ((n = data_first(cl, item)) != NULL) {
+                    cl->stack[cl->depth].list = item;
                     cl->stack[cl->depth].iterate = 1;
+                    cl->context = n;
                     return (1);
                 }
                 break;
 
-            case KORE_JSON_TYPE_OBJECT:
-                if (val != NULL && val[0] == '*' && n != NULL &&
-                        (cl->flags & Mustach_With_ObjectIter)) {
-                    cl->context = n;
+            case KORE_MUSTACH_OBJECT:
+                if (val != NULL && val[0] == '*' && (cl->flags & Mustach_With_ObjectIter) &&
+                        (n = data_first(cl, item)) != NULL) {
+                    cl->stack[cl->depth].list = item;
                     cl->stack[cl->depth].iterate = 1;
+                    cl->context = n;
                     return (1);
                 }
                 cl->context = item;
                 return (1);
 
             default:
-                if ((val != NULL && evalcomp(item, val, k)) || k == C_no) {
-                    if (json_item_islambda(item) && (rcall = kore_runtime_getcall(item->name)) != NULL) {
-                        cl->stack[cl->depth].rcall = rcall;
-                        cl->stack[cl->depth].buf = kore_buf_alloc(128);
+                if (k == C_no || evalcomp(cl, item, &key->operand, k)) {
+                    if (kind == KORE_MUSTACH_LAMBDA && (lambda = lambda_find(data_name(cl, item))) != NULL) {
+                        cl->stack[cl->depth].lambda = lambda;
+                        cl->stack[cl->depth].out = cl->out;
+                        if (lambda->cb_inplace != NULL) {
+                            cl->stack[cl->depth].start = cl->out->offset;
+                            cl->windows++;
+                        } else {
+                            cl->stack[cl->depth].buf = buf_get(cl);
+                            cl->out = cl->stack[cl->depth].buf;
+                        }
                     }
                     cl->context = item;
                     return (1);
@@ -200,35 +724,40 @@ leave(void *closure)
 {
     struct closure  *cl = closure;
     struct stack    *prev = &cl->stack[cl->depth];
-    int depth;
 
     cl->context = cl->stack[cl->depth].root;
     if (--cl->depth < 0)
         return (MUSTACH_ERROR_CLOSING);
 
-    if (prev->rcall != NULL) {
-        mustach_runtime_execute(prev->rcall->addr, prev->buf);
-
-        depth = islambda(cl);
-        if (depth)
-            kore_buf_append(cl->stack[depth].buf, prev->buf->data, prev->buf->offset);
-        else
-            kore_buf_append(cl->result, prev->buf->data, prev->buf->offset);
+    if (prev->lambda == NULL)
+        return (MUSTACH_OK);
 
-        kore_buf_free(prev->buf);
-        kore_free(prev->rcall);
+    /* an in-place lambda rewrites its section where it was rendered */
+    if (prev->buf == NULL) {
+        lambda_call(prev->lambda, cl, cl->out, prev->start);
+        cl->windows--;
+    } else {
+        lambda_call(prev->lambda, cl, prev->buf, 0);
+        cl->out = prev->out;
+        kore_buf_append(cl->out, prev->buf->data, prev->buf->offset);
+        buf_put(cl, prev->buf);
     }
 
+    if (cl->out == cl->result && cl->windows == 0 && cl->req != NULL &&
+            cl->result->offset >= cl->chunk)
+        return (stream_flush(cl, 0));
+
     return (MUSTACH_OK);
 }
 
 int
 next(void *closure)
 {
-    struct closure          *cl = closure;
-    struct kore_json_item   *n = TAILQ_NEXT(cl->context, list);
+    struct closure  *cl = closure;
+    struct stack    *top = &cl->stack[cl->depth];
+    void            *n;
 
-    if (cl->stack[cl->depth].iterate && n != NULL) {
+    if (top->iterate && (n = data_next(cl, top->list, cl->context)) != NULL) {
         cl->context = n;
         return (1);
     }
@@ -236,350 +765,3469 @@ next(void *closure)
 }
 
 int
-get(void *closure, const char *name, struct mustach_sbuf *sbuf)
+get(void *closure, const struct key *key, struct mustach_sbuf *sbuf)
 {
     struct closure              *cl = closure;
-    struct kore_runtime_call    *rcall;
-    struct kore_json_item       *item;
-    struct kore_buf             tmp;
-    enum comp                   k;
-    char                        *val, key[MUSTACH_MAX_LENGTH + 1];
+    struct lambda               *lambda;
+    void                        *item;
 
     sbuf->value = "";
+    cl->held = 0;
     if (cl->context == NULL)
         return (MUSTACH_OK);
 
-    if (name[0] == '*' && name[1] == '\0' &&
-            (cl->flags & Mustach_With_ObjectIter)) {
-
-        if (cl->context->name != NULL)
-            sbuf->value = cl->context->name;
-
+    if (key->iterate) {
+        sbuf->value = data_name(cl, cl->context);
         return (MUSTACH_OK);
     }
 
-    if (name[0] == '.' && name[1] == '\0') {
-        json_tosbuf(cl->context, sbuf);
+    if (key->self) {
+        data_tosbuf(cl, cl->context, sbuf);
         return (MUSTACH_OK);
     }
 
-    kore_strlcpy(key, name, sizeof(key));
-    keyval(key, &val, &k, cl->flags);
-    item = json_item_in_stack(cl, key);
+    item = data_in_stack(cl, key->segs, key->count);
 
-    if (item != NULL && ((val != NULL && evalcomp(item, val, k)) || k == C_no)) {
+    if (item != NULL && (key->comp == C_no || evalcomp(cl, item, &key->operand, key->comp))) {
 
-        if (json_item_islambda(item) && (rcall = kore_runtime_getcall(item->name)) != NULL) {
-            kore_buf_init(&tmp, 128);
-            mustach_runtime_execute(rcall->addr, &tmp);
-            sbuf->value = (char *)kore_buf_release(&tmp, &sbuf->length);
-            sbuf->freecb = kore_free;
-            kore_free(rcall);
+        if (data_kind(cl, item) == KORE_MUSTACH_LAMBDA &&
+                (lambda = lambda_find(data_name(cl, item))) != NULL) {
+            kore_buf_reset(&cl->scratch);
+            lambda_call(lambda, cl, &cl->scratch, 0);
+            sbuf->value = kore_buf_stringify(&cl->scratch, &sbuf->length);
         } else {
-            json_tosbuf(item, sbuf);
+            data_tosbuf(cl, item, sbuf);
         }
     }
 
     return (MUSTACH_OK);
 }
 
-int
-partial(void *closure, const char *name, struct mustach_sbuf *sbuf)
+/*
+ * Returns the partial 'name' compiled, holding a reference for the caller
+ * to drop with template_release(), or NULL if there is no such partial.
+ * Partials in the data are compiled for this use only. A name that
+ * is already cached as a file partial is not looked up in the data.
+ */
+struct kore_mustach_template *
+partial(void *closure, const char *name, int flags, int *err)
 {
-    struct closure          *cl = closure;
-    struct kore_json_item   *item = json_item_in_stack(cl, name);
+    struct closure                  *cl = closure;
+    struct kore_mustach_template    *tpl;
+    void                            *item;
+    struct mustach_sbuf             sbuf = {};
 
-    sbuf->value = "";
-    (item != NULL) ? json_tosbuf(item, sbuf) : partial_tosbuf(name, sbuf);
+    *err = MUSTACH_OK;
+    cl->stats.partials++;
 
-    return (MUSTACH_OK);
+    if ((tpl = partial_file(name, flags, 0, err)) != NULL || *err != MUSTACH_OK)
+        return (tpl);
+
+    if ((item = data_find(cl, name)) == NULL)
+        return (partial_file(name, flags, 1, err));
+
+    data_tosbuf(cl, item, &sbuf);
+    cl->stats.allocs++;
+
+    return (template_compile(sbuf.value, sbuf_length(&sbuf), flags, err));
 }
 
 int
 emit(void *closure, const char *buffer, size_t size, int escape, FILE *file)
 {
     struct closure  *cl = closure;
-    struct kore_buf tmp;
-    int depth;
+    struct kore_buf *buf = cl->out;
 
     (void)file; /* unused */
 
-    kore_buf_init(&tmp, size);
-    kore_buf_append(&tmp, buffer, size);
-
     if (escape) {
-        kore_buf_replace_string(&tmp, "&", "&amp;", 5);
-        kore_buf_replace_string(&tmp, "<", "&lt;", 4);
-        kore_buf_replace_string(&tmp, ">", "&gt;", 4);
-        kore_buf_replace_string(&tmp, "\"", "&quot;", 6);
-        /* kore_buf_replace_string(&tmp, "\\", "&#39;", 5); 
-         * kore_buf_replace_string(&tmp, "/", "&#x2F;", 6); */
+        escape_append(buf, buffer, size);
+        cl->stats.escaped += size;
+    } else {
+        kore_buf_append(buf, buffer, size);
     }
+    cl->stats.emitted += size;
 
-    depth = islambda(cl);
-    if (depth)
-        kore_buf_append(cl->stack[depth].buf, tmp.data, tmp.offset);
-    else
-        kore_buf_append(cl->result, tmp.data, tmp.offset);
+    /* the text of an open in-place lambda section must stay in the result */
+    if (buf == cl->result && cl->windows == 0 && cl->req != NULL && buf->offset >= cl->chunk)
+        return (stream_flush(cl, 0));
 
-    kore_buf_cleanup(&tmp);
     return (MUSTACH_OK);
 }
-        
-struct kore_json_item *
-json_get_item(struct kore_json_item *o, const char *name)
-{
-    struct kore_json_item   *item;
-    uint32_t                type = KORE_JSON_TYPE_OBJECT;
-
-    if (o == NULL)
-        return (NULL);
 
-    while (type <= KORE_JSON_TYPE_INTEGER_U64) {
+/*
+ * The data of a render is only ever reached through the data_ calls below,
+ * which go to the render's kore_mustach_provider if it has one and handle
+ * kore_json_item trees directly otherwise.
+ */
+int
+data_kind(struct closure *cl, void *item)
+{
+    struct kore_json_item   *o = item;
 
-        if ((item = kore_json_find(o, name, type)) != NULL)
-            return (item);
+    if (cl->provider != NULL)
+        return (cl->provider->kind(cl->arg, item));
 
-        if (kore_json_errno() != KORE_JSON_ERR_TYPE_MISMATCH)
-            return (NULL);
+    switch (o->type) {
+        case KORE_JSON_TYPE_OBJECT:
+            return (KORE_MUSTACH_OBJECT);
 
-        type = type << 1;
-    }
+        case KORE_JSON_TYPE_ARRAY:
+            return (KORE_MUSTACH_LIST);
 
-    return (NULL);
-}
+        case KORE_JSON_TYPE_LITERAL:
+            return (o->data.literal == KORE_JSON_TRUE ? KORE_MUSTACH_TRUE : KORE_MUSTACH_FALSE);
 
-void
-json_tosbuf(struct kore_json_item *o, struct mustach_sbuf *sbuf)
-{
-    char            b[50], *name;
-    struct kore_buf buf;
-   
-    switch (o->type) {
         case KORE_JSON_TYPE_STRING:
-            sbuf->value = kore_strdup(o->data.string);
-            break;
-
-        case KORE_JSON_TYPE_NUMBER:
-            sbuf->length = snprintf(b, sizeof(b), "%g", o->data.number);
-            sbuf->value = kore_strdup(b);
-            break;
+            if (o->name != NULL && !strcmp(o->data.string, "(=>)"))
+                return (KORE_MUSTACH_LAMBDA);
+            return (KORE_MUSTACH_VALUE);
 
         default:
-            name = o->name;
-            o->name = NULL;
-            kore_buf_init(&buf, 1024);
-            kore_json_item_tobuf(o, &buf);
-            o->name = name;
-            sbuf->value = (char *)kore_buf_release(&buf, &sbuf->length);
+            return (KORE_MUSTACH_VALUE);
     }
-    sbuf->freecb = kore_free;
 }
 
-struct kore_json_item *
-json_item_in_stack(struct closure *cl, const char *name)
+void *
+data_member(struct closure *cl, void *item, const char *name, size_t len)
 {
-    struct kore_json_item *o;
-    int depth;
-    
-    if ((o = json_get_item(cl->context, name)) != NULL)
-        return (o);
+    struct kore_json_item   *o = item;
 
-    depth = cl->depth;
-    while (depth && (o = json_get_item(cl->stack[depth].root, name)) == NULL)
-        depth--;
+    if (cl->provider != NULL)
+        return (cl->provider->member(cl->arg, item, name, len));
 
-    return (o);
-}
+    if (o->type != KORE_JSON_TYPE_OBJECT)
+        return (NULL);
 
-int
-json_item_islambda(struct kore_json_item *item)
-{
-    return (item->name != NULL && item->type == KORE_JSON_TYPE_STRING && !strcmp(item->data.string, "(=>)"));
+    return (json_member(cl, o, name, len));
 }
 
-void
-keyval(char *key, char **val, enum comp *k, int flags)
+/* The first element of a list, or the first member of an object. */
+void *
+data_first(struct closure *cl, void *item)
 {
-    char    *s, *o;
+    struct kore_json_item   *o = item;
 
-    *val = NULL;
-    *k = C_no;
+    if (cl->provider != NULL)
+        return (cl->provider->first(cl->arg, item));
 
-    for (o = s = key; *s != '\0' && *val == NULL; s++) {
-        switch (*s) {
-            case '*':
-                if (flags & Mustach_With_ObjectIter) {
-                    *val = "*";
-                    continue;
-                }
-                break;
+    if (o->type != KORE_JSON_TYPE_OBJECT && o->type != KORE_JSON_TYPE_ARRAY)
+        return (NULL);
 
-            case '<':
-            case '>':
-                if (flags & Mustach_With_Compare) {
-                    if (*s == '<')
-                        *k = C_lt;
-                    else
-                        *k = C_gt;
+    return (TAILQ_FIRST(&o->data.items));
+}
 
-                    if (*++s == '=') {
-                        (*k)++;
-                        s++;
-                    }
-                    *val = s;
-                    continue;
-                }
-                break;
+/* The element or member of 'list' after 'item'. */
+void *
+data_next(struct closure *cl, void *list, void *item)
+{
+    if (cl->provider != NULL)
+        return (cl->provider->next(cl->arg, list, item));
 
-            case '=':
-                if (flags & Mustach_With_Equal) {
-                    *k = C_eq;
-                    *val = ++s;
-                    continue;
-                }
-                break;
+    return (TAILQ_NEXT((struct kore_json_item *)item, list));
+}
 
-            case '~':
-                if (flags & Mustach_With_JsonPointer) {
-                    switch (*++s) {
-                        case '1': *o++ = '/'; break;
-                        case '0': *o++ = '~'; break;
-                        default: *o++ = *--s; break;
-                    }
-                    continue;
-                }
-                break;
+/* The member name of 'item', never NULL. */
+const char *
+data_name(struct closure *cl, void *item)
+{
+    const char  *name;
 
-            case '.':
-                *o++ = '/';
-                continue;
+    if (cl->provider == NULL)
+        name = ((struct kore_json_item *)item)->name;
+    else if (cl->provider->name != NULL)
+        name = cl->provider->name(cl->arg, item);
+    else
+        name = NULL;
 
-            case '\\':
-                s++;
-        }
-        *o++ = *s;
+    return (name != NULL ? name : "");
+}
+
+void
+data_tosbuf(struct closure *cl, void *item, struct mustach_sbuf *sbuf)
+{
+    if (cl->provider == NULL) {
+        json_tosbuf(cl, item, sbuf);
+        return;
     }
-    *o = '\0';
+
+    /* an empty value is measured with strlen(), terminate it */
+    kore_buf_reset(&cl->scratch);
+    cl->provider->tostring(cl->arg, item, &cl->scratch);
+    sbuf->value = kore_buf_stringify(&cl->scratch, &sbuf->length);
 }
 
+/*
+ * A provider without a compare callback has its items compared as the
+ * strings they render to.
+ */
 int
-compare(struct kore_json_item *o, const char *value)
+data_compare(struct closure *cl, void *item, const struct operand *op)
 {
-    double      d;
-    int64_t     i;
-    uint64_t    u;
-    int         err;
+    struct mustach_sbuf sbuf = {};
+    size_t              len;
+    int                 c;
 
-    switch (o->type) {
-        case KORE_JSON_TYPE_NUMBER:
-            d = kore_strtodouble(value, DBL_MIN, DBL_MAX, &err);
-            return (!err) ? 0 : (o->data.number > d) - (o->data.number < d);
+    if (cl->provider == NULL)
+        return (compare(item, op));
 
-        case KORE_JSON_TYPE_INTEGER:
-            i = kore_strtonum64(value, 1, &err);
-            return (!err) ? 0 : (o->data.integer > i) - (o->data.integer < i);
+    if (cl->provider == &lazy_provider)
+        return (lazy_compare(cl->arg, item, op));
 
-        case KORE_JSON_TYPE_INTEGER_U64:
-            u = kore_strtonum64(value, 0, &err);
-            return (!err) ? 0 : (o->data.u64 > u) - (o->data.u64 < u);
+    if (cl->provider->compare != NULL)
+        return (cl->provider->compare(cl->arg, item, op->str));
 
-        case KORE_JSON_TYPE_STRING:
-            return (strcmp(o->data.string, value));
+    data_tosbuf(cl, item, &sbuf);
+    len = sbuf_length(&sbuf);
+    if ((c = memcmp(sbuf.value, op->str, len < op->len ? len : op->len)) != 0)
+        return (c);
 
-        default: return (0);
-    }
+    return ((len > op->len) - (len < op->len));
 }
 
-int
-evalcomp(struct kore_json_item *o, const char *value, enum comp k)
+/*
+ * Resolves the path 'segs' from 'o', returning the first member matching
+ * each segment whatever its type, like kore_json_find().
+ */
+void *
+data_get(struct closure *cl, void *o, const struct seg *segs, size_t count)
 {
-    int c, rc, flip = (value[0] == '!');
-
-    c = compare(o, &value[flip]);
-    switch (k) {
-        case C_eq: rc = (c == 0); break;
-        case C_lt: rc = (c < 0); break;
-        case C_le: rc = (c <= 0); break;
-        case C_gt: rc = (c > 0); break;
-        case C_ge: rc = (c >= 0); break;
-        default: return (0);
-    }
-    return (flip ? !rc : rc);
-}
+    size_t  i;
 
-int
-islambda(struct closure *cl)
-{
-    int depth = cl->depth;
+    if (count == 0)
+        return (NULL);
 
-    while (depth && cl->stack[depth].rcall == NULL) depth--;
+    for (i = 0; i < count && o != NULL; i++)
+        o = data_member(cl, o, segs[i].name, segs[i].len);
 
-    return (depth);
+    return (o);
 }
 
-void
-partial_tosbuf(const char *path, struct mustach_sbuf *sbuf)
+struct kore_json_item *
+json_member(struct closure *cl, struct kore_json_item *o, const char *name, size_t len)
 {
-    struct kore_server srv = { .tls = 1 };
-    struct kore_fileref *ref;
-    struct stat st;
-    int fd;
+    struct kore_json_item   *item;
+    struct index_entry      *e;
 
-    if ((ref = kore_fileref_get(path, srv.tls)) == NULL) {
-        if ((fd = open(path, O_RDONLY | O_NOFOLLOW)) == -1)
-            return;
+    if (cl->index.size == 0)
+        index_grow(&cl->index);
 
-        if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
-            close(fd);
-            return;
-        }
+    e = index_slot(&cl->index, o, NULL, 0, index_hash(o, NULL, 0));
+    if (e->parent == NULL) {
+        index_object(&cl->index, o);
+        e = index_slot(&cl->index, o, NULL, 0, index_hash(o, NULL, 0));
+    }
 
-        if ((ref = kore_fileref_create(&srv, path, fd, st.st_size, &st.st_mtim)) == NULL) {
-            close(fd);
-            return;
-        }
+    if (e->item != NULL) {
+        e = index_slot(&cl->index, o, name, len, index_hash(o, name, len));
+        return (e->item);
     }
 
-    if (ref->base != NULL) {
-        sbuf->value = ref->base;
-        sbuf->length = ref->size;
+    TAILQ_FOREACH(item, &o->data.items, list) {
+        if (item->name != NULL && !strncmp(item->name, name, len) && item->name[len] == '\0')
+            return (item);
     }
 
-    sbuf->releasecb = releasecb;
-    sbuf->closure = ref;
+    return (NULL);
 }
 
+/*
+ * Strings are handed out as is, they live as long as the render. Numbers
+ * and literals are formatted into the closure, objects and arrays into the
+ * render's scratch buffer. Both stay valid until the next call since
+ * mustach emits every value before asking for another one.
+ */
 void
-releasecb(const char *value, void *closure)
+json_tosbuf(struct closure *cl, struct kore_json_item *o, struct mustach_sbuf *sbuf)
 {
-    struct kore_fileref *ref = closure;
+    struct kore_json_item   anon;
 
-    (void)value; /* unused */
-    kore_fileref_release(ref);
+    if (o->type == KORE_JSON_TYPE_STRING) {
+        sbuf->value = o->data.string;
+        sbuf->length = strlen(o->data.string);
+        cl->held = 1;
+        return;
+    }
+
+    if ((sbuf->value = json_scalar(o, cl->number, &sbuf->length)) != NULL)
+        return;
+
+    /*
+     * Written without its name from a copy, the item itself may be read
+     * by parallel sections on other threads. The copy shares the members,
+     * which kore_json_item_tobuf() only walks forward.
+     */
+    anon = *o;
+    anon.name = NULL;
+    kore_buf_reset(&cl->scratch);
+    kore_json_item_tobuf(&anon, &cl->scratch);
+
+    sbuf->value = (char *)cl->scratch.data;
+    sbuf->length = cl->scratch.offset;
+}
+
+/*
+ * Returns the text of the number or literal 'o' as kore_json_item_tobuf()
+ * writes it, formatted into 'buf' of NUMBER_MAX bytes when needed and not
+ * terminated, or NULL for any other type.
+ */
+const char *
+json_scalar(struct kore_json_item *o, char *buf, size_t *len)
+{
+    switch (o->type) {
+        case KORE_JSON_TYPE_NUMBER:
+            *len = fmt_double(buf, o->data.number);
+            return (buf);
+
+        case KORE_JSON_TYPE_INTEGER:
+            *len = fmt_i64(buf, o->data.integer);
+            return (buf);
+
+        case KORE_JSON_TYPE_INTEGER_U64:
+            *len = fmt_u64(buf, o->data.u64);
+            return (buf);
+
+        case KORE_JSON_TYPE_LITERAL:
+            switch (o->data.literal) {
+                case KORE_JSON_TRUE:
+                    *len = 4;
+                    return ("true");
+                case KORE_JSON_FALSE:
+                    *len = 5;
+                    return ("false");
+                default:
+                    *len = 4;
+                    return ("null");
+            }
+
+        default:
+            return (NULL);
+    }
+}
+
+/* Writes 'v' in decimal to 'buf', two digits at a time. Returns the length. */
+size_t
+fmt_u64(char *buf, u_int64_t v)
+{
+    char    tmp[20], *p = tmp + sizeof(tmp);
+    size_t  len;
+
+    for (; v >= 100; v /= 100) {
+        p -= 2;
+        memcpy(p, &digits[(v % 100) * 2], 2);
+    }
+
+    if (v >= 10) {
+        p -= 2;
+        memcpy(p, &digits[v * 2], 2);
+    } else {
+        *--p = '0' + v;
+    }
+
+    len = tmp + sizeof(tmp) - p;
+    memcpy(buf, p, len);
+
+    return (len);
+}
+
+size_t
+fmt_i64(char *buf, int64_t v)
+{
+    if (v < 0) {
+        buf[0] = '-';
+        return (fmt_u64(buf + 1, -(u_int64_t)v) + 1);
+    }
+
+    return (fmt_u64(buf, v));
+}
+
+/*
+ * Writes 'd' to 'buf' exactly as printf("%g") would. A value printf writes
+ * without an exponent is scaled to its six significant digits and those
+ * are printed as an integer. Anything else, or a value too close to a
+ * rounding tie to be sure which way printf rounds it, goes to snprintf().
+ */
+size_t
+fmt_double(char *buf, double d)
+{
+    static const double scale[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9
+    };
+    static const double bound[] = {
+        1e-4, 1e-3, 1e-2, 1e-1, 1e0, 1e1, 1e2, 1e3, 1e4, 1e5
+    };
+    double      a = d < 0 ? -d : d, v, frac;
+    u_int64_t   m;
+    char        *p = buf, six[6];
+    int         x;
+
+    /* also turns away zero, infinities and NaN */
+    if (!(a >= 1e-4 && a < 1e6))
+        return (snprintf(buf, NUMBER_MAX, "%g", d));
+
+    /* the decimal exponent, the first significant digit is 10^x */
+    for (x = 5; a < bound[x + 4]; x--)
+        ;
+
+    v = a * scale[5 - x];
+    m = (u_int64_t)v;
+    frac = v - m;
+
+    if (frac > 0.5 - 1e-9 && frac < 0.5 + 1e-9)
+        return (snprintf(buf, NUMBER_MAX, "%g", d));
+
+    if (frac > 0.5)
+        m++;
+
+    if (m < 100000 || m > 999999)
+        return (snprintf(buf, NUMBER_MAX, "%g", d));
+
+    fmt_u64(six, m);
+
+    if (d < 0)
+        *p++ = '-';
+
+    if (x >= 0) {
+        memcpy(p, six, x + 1);
+        p += x + 1;
+        *p++ = '.';
+        memcpy(p, six + x + 1, 5 - x);
+        p += 5 - x;
+    } else {
+        memcpy(p, "0.000", 1 - x);
+        p += 1 - x;
+        memcpy(p, six, sizeof(six));
+        p += sizeof(six);
+    }
+
+    /* %g drops trailing zeros, and the point with them */
+    while (p[-1] == '0')
+        p--;
+    if (p[-1] == '.')
+        p--;
+
+    return (p - buf);
+}
+
+void *
+data_in_stack(struct closure *cl, const struct seg *segs, size_t count)
+{
+    void    *o;
+    int     depth;
+
+    cl->stats.lookups++;
+    cl->stats.frames++;
+
+    if ((o = data_get(cl, cl->context, segs, count)) != NULL)
+        return (o);
+
+    depth = cl->depth;
+    while (depth && (o = data_get(cl, cl->stack[depth].root, segs, count)) == NULL) {
+        cl->stats.frames++;
+        depth--;
+    }
+
+    if (depth)
+        cl->stats.frames++;
+    else
+        cl->stats.misses++;
+
+    return (o);
+}
+
+/*
+ * Looks up a '/' separated path given verbatim, as partial names and
+ * kore_mustach_find() do, without any of the keyval() rewriting.
+ */
+void *
+data_find(struct closure *cl, const char *name)
+{
+    struct seg  segs[MUSTACH_MAX_DEPTH];
+    int         count;
+
+    if ((count = path_split(name, segs)) == -1)
+        return (NULL);
+
+    return (data_in_stack(cl, segs, count));
+}
+
+/* Splits 'name' at its '/' into at most MUSTACH_MAX_DEPTH segments, or -1. */
+int
+path_split(const char *name, struct seg *segs)
+{
+    const char  *end;
+    int         count = 0;
+
+    for (; *name != '\0'; name = end) {
+        if ((end = strchr(name, '/')) == NULL)
+            end = name + strlen(name);
+
+        if (end != name) {
+            if (count == MUSTACH_MAX_DEPTH)
+                return (-1);
+            segs[count++] = (struct seg){ name, end - name };
+        }
+
+        if (*end == '/')
+            end++;
+    }
+
+    return (count);
+}
+
+/*
+ * Finds 'name' as a kore_json_item for kore_mustach_find(), building it
+ * from a lazily parsed document. Other providers have none to give.
+ */
+struct kore_json_item *
+json_find(struct closure *cl, const char *name)
+{
+    if (cl->provider == &lazy_provider)
+        return (lazy_item(cl, data_find(cl, name)));
+
+    if (cl->provider != NULL)
+        return (NULL);
+
+    return (data_find(cl, name));
+}
+
+/* kore_mustach() on a document only indexed, its values decoded as needed. */
+int
+lazy_render(const char *template, const char *data, int flags, struct kore_buf **result)
+{
+    struct lazy_json                doc = {};
+    struct kore_mustach_template    *tpl;
+    int                             rc = KORE_RESULT_ERROR;
+
+    *result = NULL;
+
+    if (!lazy_index(&doc, data, strlen(data))) {
+        mustach_errno = MUSTACH_ERROR_INVALID_ITF;
+    } else if ((tpl = kore_mustach_compile(template, flags)) != NULL) {
+        rc = kore_mustach_render_data(tpl, &lazy_provider, &doc, &doc.toks[0], result);
+        kore_mustach_template_free(tpl);
+    }
+
+    lazy_cleanup(&doc);
+    return (rc);
+}
+
+/*
+ * Records the structural characters of 'data' outside of strings, checking
+ * that they nest and follow each other as json allows. Strings, numbers
+ * and literals are only checked once a render decodes them.
+ */
+int
+lazy_index(struct lazy_json *doc, const char *data, size_t length)
+{
+    const char  *p = data, *end = data + length;
+    size_t      open[KORE_JSON_DEPTH_MAX];
+    int         depth = 0, value, ok;
+    char        c, last = '\0', parent;
+
+    doc->data = data;
+    doc->length = length;
+    doc->size = length / 16 + 16;
+    doc->toks = kore_calloc(doc->size, sizeof(*doc->toks));
+    kore_buf_init(&doc->tmp, 64);
+
+    if (length > UINT32_MAX)
+        return (0);
+
+    /* the root value follows a token of its own */
+    lazy_push(doc, 0);
+
+    while ((p = lazy_scan(p, end)) < end) {
+        if ((c = *p++) == '"') {
+            while ((p = lazy_scan_string(p, end)) < end && *p == '\\')
+                p += 2;
+            if (p >= end)
+                return (0);
+            p++;
+            continue;
+        }
+
+        parent = depth ? lazy_char(doc, open[depth - 1]) : '\0';
+        value = !lazy_blank(data + doc->toks[doc->count - 1].pos, p - 1);
+
+        if (c == '{' || c == '[') {
+            ok = !value && depth < KORE_JSON_DEPTH_MAX && (parent == '{' ? last == ':' :
+                parent == '[' ? last != '}' && last != ']' : last == '\0');
+        } else if (last == '}' || last == ']') {
+            ok = !value && parent != '\0' && (c == ',' || c == parent + 2);
+        } else if (parent == '{') {
+            ok = last == ':' ? value && (c == ',' || c == '}') :
+                c == ':' ? value : c == '}' && last == '{' && !value;
+        } else if (parent == '[') {
+            ok = c == ',' ? value : c == ']' && (value || last == '[');
+        } else {
+            ok = 0;
+        }
+
+        if (!ok)
+            return (0);
+
+        if (c == '{' || c == '[')
+            open[depth++] = doc->count;
+        else if (c == '}' || c == ']')
+            doc->toks[open[--depth]].close = doc->count;
+
+        lazy_push(doc, p - data);
+        last = c;
+    }
+
+    return (depth == 0 && last != '\0' && lazy_blank(data + doc->toks[doc->count - 1].pos, end));
+}
+
+void
+lazy_cleanup(struct lazy_json *doc)
+{
+    kore_free(doc->toks);
+    kore_buf_cleanup(&doc->tmp);
+    arena_free(&doc->arena);
+
+    if (doc->held != NULL)
+        kore_json_item_free(doc->held);
+}
+
+void
+lazy_push(struct lazy_json *doc, size_t pos)
+{
+    if (doc->count == doc->size) {
+        doc->size *= 2;
+        doc->toks = kore_realloc(doc->toks, doc->size * sizeof(*doc->toks));
+    }
+
+    doc->toks[doc->count].pos = pos;
+    doc->toks[doc->count].close = 0;
+    doc->count++;
+}
+
+/* Returns whether [p, end) is only json whitespace. */
+int
+lazy_blank(const char *p, const char *end)
+{
+    for (; p < end; p++) {
+        if (!JSON_SPACE(*p))
+            return (0);
+    }
+
+    return (1);
+}
+
+/* Returns the first quote or structural character in [p, end) or end. */
+const char *
+lazy_scan(const char *p, const char *end)
+{
+#if defined(__SSE2__)
+    const __m128i   quot = _mm_set1_epi8('"'), colon = _mm_set1_epi8(':');
+    const __m128i   comma = _mm_set1_epi8(','), low = _mm_set1_epi8(0x20);
+    const __m128i   open = _mm_set1_epi8('{'), close = _mm_set1_epi8('}');
+    __m128i         v, b;
+    u_int32_t       m;
+
+    /* '[' and ']' only differ from '{' and '}' by 0x20 */
+    for (; end - p >= 16; p += 16) {
+        v = _mm_loadu_si128((const __m128i *)p);
+        b = _mm_or_si128(v, low);
+        m = _mm_movemask_epi8(_mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, quot), _mm_cmpeq_epi8(v, colon)),
+            _mm_or_si128(_mm_cmpeq_epi8(v, comma),
+            _mm_or_si128(_mm_cmpeq_epi8(b, open), _mm_cmpeq_epi8(b, close)))));
+        if (m != 0)
+            return (p + __builtin_ctz(m));
+    }
+#endif
+
+    for (; p < end; p++) {
+        if (structural[(unsigned char)*p])
+            break;
+    }
+
+    return (p);
+}
+
+/* Returns the first quote or backslash in [p, end) or end. */
+const char *
+lazy_scan_string(const char *p, const char *end)
+{
+#if defined(__SSE2__)
+    const __m128i   quot = _mm_set1_epi8('"'), bslash = _mm_set1_epi8('\\');
+    __m128i         v;
+    u_int32_t       m;
+
+    for (; end - p >= 16; p += 16) {
+        v = _mm_loadu_si128((const __m128i *)p);
+        m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, quot), _mm_cmpeq_epi8(v, bslash)));
+        if (m != 0)
+            return (p + __builtin_ctz(m));
+    }
+#endif
+
+    for (; p < end; p++) {
+        if (*p == '"' || *p == '\\')
+            break;
+    }
+
+    return (p);
+}
+
+/* The character of token 't', '\0' for the root's. */
+char
+lazy_char(struct lazy_json *doc, size_t t)
+{
+    return (t == 0 ? '\0' : doc->data[doc->toks[t].pos - 1]);
+}
+
+/* The first character of the value after token 't'. */
+const char *
+lazy_value(struct lazy_json *doc, size_t t)
+{
+    const char  *p = doc->data + doc->toks[t].pos, *end = doc->data + doc->length;
+
+    while (p < end && JSON_SPACE(*p))
+        p++;
+
+    return (p);
+}
+
+/* The end of the scalar value after token 't'. */
+const char *
+lazy_end(struct lazy_json *doc, size_t t)
+{
+    const char  *s = lazy_value(doc, t), *e;
+
+    if (t + 1 < doc->count)
+        e = doc->data + doc->toks[t + 1].pos - 1;
+    else
+        e = doc->data + doc->length;
+
+    while (e > s && JSON_SPACE(e[-1]))
+        e--;
+
+    return (e);
+}
+
+/* The token after the value that follows token 't'. */
+size_t
+lazy_after(struct lazy_json *doc, size_t t)
+{
+    const char  *v = lazy_value(doc, t);
+
+    if (*v == '{' || *v == '[')
+        return (doc->toks[t + 1].close + 1);
+
+    return (t + 1);
+}
+
+/* Sets [s, e) to the key of the member ending at the ':' token 't', unquoted. */
+int
+lazy_key(struct lazy_json *doc, size_t t, const char **s, const char **e)
+{
+    if (lazy_char(doc, t) != ':')
+        return (0);
+
+    *s = lazy_value(doc, t - 1);
+    *e = doc->data + doc->toks[t].pos - 1;
+    while (*e > *s && JSON_SPACE((*e)[-1]))
+        (*e)--;
+
+    if (*e - *s < 2 || **s != '"' || (*e)[-1] != '"')
+        return (0);
+
+    (*s)++;
+    (*e)--;
+
+    return (1);
+}
+
+/* Decodes the string inside the quotes of [s, e) into doc->tmp. */
+int
+lazy_string(struct lazy_json *doc, const char *s, const char *e)
+{
+    const char      *p;
+    unsigned int    cp;
+    u_int8_t        utf[3];
+    char            c, hex[5];
+
+    kore_buf_reset(&doc->tmp);
+
+    for (s++, e--;; s = p + 1) {
+        if ((p = memchr(s, '\\', e - s)) == NULL) {
+            kore_buf_append(&doc->tmp, s, e - s);
+            break;
+        }
+
+        kore_buf_append(&doc->tmp, s, p - s);
+        if (++p == e)
+            return (0);
+
+        switch ((c = *p)) {
+            case 'b': c = '\b'; break;
+            case 'f': c = '\f'; break;
+            case 'n': c = '\n'; break;
+            case 'r': c = '\r'; break;
+            case 't': c = '\t'; break;
+            case '"':
+            case '/':
+            case '\\':
+                break;
+            case 'u':
+                if (e - p < 5)
+                    return (0);
+                memcpy(hex, p + 1, 4);
+                hex[4] = '\0';
+                p += 4;
+                cp = strtoul(hex, NULL, 16);
+                if (cp < 0x80) {
+                    utf[0] = cp;
+                    kore_buf_append(&doc->tmp, utf, 1);
+                } else if (cp < 0x800) {
+                    utf[0] = 0xc0 | (cp >> 6);
+                    utf[1] = 0x80 | (cp & 0x3f);
+                    kore_buf_append(&doc->tmp, utf, 2);
+                } else {
+                    utf[0] = 0xe0 | (cp >> 12);
+                    utf[1] = 0x80 | ((cp >> 6) & 0x3f);
+                    utf[2] = 0x80 | (cp & 0x3f);
+                    kore_buf_append(&doc->tmp, utf, 3);
+                }
+                continue;
+            default:
+                return (0);
+        }
+
+        kore_buf_append(&doc->tmp, &c, 1);
+    }
+
+    kore_buf_stringify(&doc->tmp, NULL);
+    return (1);
+}
+
+/*
+ * Decodes the scalar after token 't' into 'o' typed the way kore_json_parse()
+ * types it. A string is left in doc->tmp.
+ */
+int
+lazy_scalar(struct lazy_json *doc, size_t t, struct kore_json_item *o)
+{
+    const char  *s = lazy_value(doc, t), *e = lazy_end(doc, t);
+    size_t      len = e - s;
+    char        num[64];
+    int         err;
+
+    memset(o, 0, sizeof(*o));
+
+    switch (*s) {
+        case '"':
+            if (len < 2 || e[-1] != '"' || !lazy_string(doc, s, e))
+                return (0);
+            o->type = KORE_JSON_TYPE_STRING;
+            o->data.string = (char *)doc->tmp.data;
+            return (1);
+
+        case 't':
+        case 'f':
+        case 'n':
+            o->type = KORE_JSON_TYPE_LITERAL;
+            if (len == 4 && !memcmp(s, "true", 4))
+                o->data.literal = KORE_JSON_TRUE;
+            else if (len == 5 && !memcmp(s, "false", 5))
+                o->data.literal = KORE_JSON_FALSE;
+            else if (len == 4 && !memcmp(s, "null", 4))
+                o->data.literal = KORE_JSON_NULL;
+            else
+                return (0);
+            return (1);
+    }
+
+    if (len == 0 || len >= sizeof(num))
+        return (0);
+
+    memcpy(num, s, len);
+    num[len] = '\0';
+    if (strspn(num, "0123456789-+.eE") != len)
+        return (0);
+
+    if (strpbrk(num, ".eE+") == NULL) {
+        o->type = KORE_JSON_TYPE_INTEGER;
+        if (num[0] == '-') {
+            o->data.integer = kore_strtonum64(num, 1, &err);
+        } else {
+            o->data.u64 = (u_int64_t)kore_strtonum64(num, 0, &err);
+            if (o->data.u64 > INT64_MAX)
+                o->type = KORE_JSON_TYPE_INTEGER_U64;
+        }
+        return (err == KORE_RESULT_OK);
+    }
+
+    o->type = KORE_JSON_TYPE_NUMBER;
+    o->data.number = kore_strtodouble(num, -DBL_MAX, DBL_MAX, &err);
+
+    return (err == KORE_RESULT_OK);
+}
+
+/* Parses the object or array after token 't' into kore_json_items. */
+struct kore_json_item *
+lazy_parse(struct lazy_json *doc, size_t t)
+{
+    struct kore_json        json;
+    struct kore_json_item   *item = NULL;
+    const char              *v = lazy_value(doc, t);
+    const char              *e = doc->data + doc->toks[doc->toks[t + 1].close].pos;
+
+    kore_json_init(&json, (const u_int8_t *)v, e - v);
+    if (kore_json_parse(&json)) {
+        item = json.root;
+        json.root = NULL;
+    }
+    kore_json_cleanup(&json);
+
+    return (item);
+}
+
+/*
+ * The kore_json_item kore_mustach_find() hands out for 'item', built on
+ * demand and freed with the document.
+ */
+struct kore_json_item *
+lazy_item(struct closure *cl, void *item)
+{
+    struct lazy_json        *doc = cl->arg;
+    struct kore_json_item   o, *json;
+    const char              *v, *name;
+    size_t                  t;
+
+    if (item == NULL)
+        return (NULL);
+
+    t = (struct lazy_tok *)item - doc->toks;
+    v = lazy_value(doc, t);
+
+    if (*v == '{' || *v == '[') {
+        if ((json = lazy_parse(doc, t)) == NULL)
+            return (NULL);
+    } else {
+        if (!lazy_scalar(doc, t, &o))
+            return (NULL);
+        json = kore_calloc(1, sizeof(*json));
+        json->type = o.type;
+        json->data = o.data;
+        if (o.type == KORE_JSON_TYPE_STRING)
+            json->data.string = kore_strdup(o.data.string);
+    }
+
+    if ((name = lazy_name(doc, item)) != NULL)
+        json->name = kore_strdup(name);
+
+    if (doc->held == NULL)
+        doc->held = kore_json_create_array(NULL, NULL);
+    kore_json_item_attach(doc->held, json);
+
+    return (json);
+}
+
+int
+lazy_kind(void *arg, void *item)
+{
+    struct lazy_json    *doc = arg;
+    size_t              t = (struct lazy_tok *)item - doc->toks;
+    const char          *s = lazy_value(doc, t), *e = lazy_end(doc, t);
+
+    switch (*s) {
+        case '{':
+            return (KORE_MUSTACH_OBJECT);
+
+        case '[':
+            return (KORE_MUSTACH_LIST);
+
+        case 't':
+            return (e - s == 4 && !memcmp(s, "true", 4) ? KORE_MUSTACH_TRUE : KORE_MUSTACH_FALSE);
+
+        case '"':
+            if (lazy_char(doc, t) == ':' && e - s == 6 && !memcmp(s, "\"(=>)\"", 6))
+                return (KORE_MUSTACH_LAMBDA);
+            return (KORE_MUSTACH_VALUE);
+
+        default:
+            return (*s == '-' || isdigit((unsigned char)*s) ? KORE_MUSTACH_VALUE : KORE_MUSTACH_FALSE);
+    }
+}
+
+void *
+lazy_member(void *arg, void *object, const char *name, size_t len)
+{
+    struct lazy_json    *doc = arg;
+    struct lazy_tok     *m;
+    const char          *s, *e;
+
+    if (*lazy_value(doc, (struct lazy_tok *)object - doc->toks) != '{')
+        return (NULL);
+
+    for (m = lazy_first(doc, object); m != NULL; m = lazy_next(doc, object, m)) {
+        if (!lazy_key(doc, m - doc->toks, &s, &e))
+            continue;
+
+        if (memchr(s, '\\', e - s) == NULL) {
+            if ((size_t)(e - s) == len && !memcmp(s, name, len))
+                return (m);
+        } else if (lazy_string(doc, s - 1, e + 1) && doc->tmp.offset == len &&
+                !memcmp(doc->tmp.data, name, len)) {
+            return (m);
+        }
+    }
+
+    return (NULL);
+}
+
+void *
+lazy_first(void *arg, void *item)
+{
+    struct lazy_json    *doc = arg;
+    size_t              t = (struct lazy_tok *)item - doc->toks;
+    const char          *v = lazy_value(doc, t);
+
+    /* a member is the ':' after its key, an element the '[' or ',' before it */
+    if (*v == '{' && doc->toks[t + 1].close != t + 2)
+        return (&doc->toks[t + 2]);
+
+    if (*v == '[' && *lazy_value(doc, t + 1) != ']')
+        return (&doc->toks[t + 1]);
+
+    return (NULL);
+}
+
+void *
+lazy_next(void *arg, void *list, void *item)
+{
+    struct lazy_json    *doc = arg;
+    size_t              t = (struct lazy_tok *)item - doc->toks;
+    size_t              n = lazy_after(doc, t);
+
+    (void)list; /* unused */
+
+    if (n >= doc->count || lazy_char(doc, n) != ',')
+        return (NULL);
+
+    return (lazy_char(doc, t) == ':' ? &doc->toks[n + 1] : &doc->toks[n]);
+}
+
+const char *
+lazy_name(void *arg, void *item)
+{
+    struct lazy_json    *doc = arg;
+    const char          *s, *e;
+    char                *name;
+
+    if (!lazy_key(doc, (struct lazy_tok *)item - doc->toks, &s, &e) ||
+            !lazy_string(doc, s - 1, e + 1))
+        return (NULL);
+
+    name = arena_calloc(&doc->arena, 1, doc->tmp.offset + 1);
+    memcpy(name, doc->tmp.data, doc->tmp.offset);
+
+    return (name);
+}
+
+/* Writes a value the way json_tosbuf() does. */
+void
+lazy_tostring(void *arg, void *item, struct kore_buf *buf)
+{
+    struct lazy_json        *doc = arg;
+    struct kore_json_item   o, *json;
+    size_t                  t = (struct lazy_tok *)item - doc->toks, len;
+    const char              *v = lazy_value(doc, t), *text;
+    char                    number[NUMBER_MAX];
+
+    if (*v == '{' || *v == '[') {
+        if ((json = lazy_parse(doc, t)) != NULL) {
+            kore_json_item_tobuf(json, buf);
+            kore_json_item_free(json);
+        }
+        return;
+    }
+
+    if (!lazy_scalar(doc, t, &o))
+        return;
+
+    if (o.type == KORE_JSON_TYPE_STRING)
+        kore_buf_append(buf, doc->tmp.data, doc->tmp.offset);
+    else if ((text = json_scalar(&o, number, &len)) != NULL)
+        kore_buf_append(buf, text, len);
+}
+
+/* Compares without the detour through the public string operand. */
+int
+lazy_compare(struct lazy_json *doc, void *item, const struct operand *op)
+{
+    struct kore_json_item   o;
+
+    if (!lazy_scalar(doc, (struct lazy_tok *)item - doc->toks, &o))
+        return (0);
+
+    return (compare(&o, op));
+}
+
+void
+keyval(char *key, char **val, enum comp *k, int flags)
+{
+    char    *s, *o;
+
+    *val = NULL;
+    *k = C_no;
+
+    for (o = s = key; *s != '\0' && *val == NULL; s++) {
+        switch (*s) {
+            case '*':
+                if (flags & Mustach_With_ObjectIter) {
+                    *val = "*";
+                    continue;
+                }
+                break;
+
+            case '<':
+            case '>':
+                if (flags & Mustach_With_Compare) {
+                    if (*s == '<')
+                        *k = C_lt;
+                    else
+                        *k = C_gt;
+
+                    if (*++s == '=') {
+                        (*k)++;
+                        s++;
+                    }
+                    *val = s;
+                    continue;
+                }
+                break;
+
+            case '=':
+                if (flags & Mustach_With_Equal) {
+                    *k = C_eq;
+                    *val = ++s;
+                    continue;
+                }
+                break;
+
+            case '.':
+                *o++ = '/';
+                continue;
+
+            case '\\':
+                s++;
+        }
+        *o++ = *s;
+    }
+    *o = '\0';
+}
+
+struct key *
+key_parse(const char *name, int flags)
+{
+    struct key  *key;
+    const char  *c;
+    char        *p, *end, *val;
+    size_t      n, len;
+    int         cache = 0;
+
+    if (flags & Mustach_With_Compare)
+        flags |= Mustach_With_Equal;
+
+    if ((flags & Mustach_With_FragmentCache) && !strncmp(name, "cache:", 6)) {
+        cache = 1;
+        name += 6;
+    }
+
+    /* every separator keyval() may produce starts at one of these */
+    for (n = 1, c = name; *c != '\0'; c++)
+        n += (*c == '/' || *c == '.');
+
+    /* the key, its segments and the rewritten path share one allocation */
+    len = strlen(name) + 1;
+    key = kore_calloc(1, sizeof(*key) + n * sizeof(*key->segs) + len);
+    key->segs = (struct seg *)(key + 1);
+    key->path = (char *)(key->segs + n);
+    memcpy(key->path, name, len);
+
+    key->cache = cache;
+    key->self = !strcmp(name, ".");
+    key->iterate = !strcmp(name, "*") && (flags & Mustach_With_ObjectIter);
+
+    keyval(key->path, &val, &key->comp, flags);
+    key->value = val;
+    if (key->comp != C_no)
+        operand_parse(&key->operand, val);
+
+    /* the operand stays in place behind the path, keyval() terminated it */
+    for (p = key->path; *p != '\0'; p = end) {
+        if ((end = strchr(p, '/')) == NULL)
+            end = p + strlen(p);
+
+        if (*end == '/')
+            *end++ = '\0';
+
+        /* '~1' is a '/' within a member name, not a separator */
+        if (*p != '\0' && (flags & Mustach_With_JsonPointer))
+            pointer_unescape(p);
+
+        if (*p != '\0')
+            key->segs[key->count++] = (struct seg){ p, strlen(p) };
+    }
+
+    return (key);
+}
+
+/* Decodes the json pointer escapes '~1' and '~0' of 'name' in place. */
+void
+pointer_unescape(char *name)
+{
+    char    *s, *o;
+
+    for (o = s = name; *s != '\0'; s++) {
+        if (s[0] == '~' && s[1] == '1') {
+            *o++ = '/';
+            s++;
+        } else if (s[0] == '~' && s[1] == '0') {
+            *o++ = '~';
+            s++;
+        } else {
+            *o++ = *s;
+        }
+    }
+    *o = '\0';
+}
+
+/*
+ * Parses the operand 'value' the ways compare() may need it. An operand
+ * that does not parse as a type compares equal to values of that type.
+ */
+void
+operand_parse(struct operand *op, const char *value)
+{
+    op->flip = (value[0] == '!');
+    op->str = &value[op->flip];
+    op->len = strlen(op->str);
+
+    op->d = kore_strtodouble(op->str, DBL_MIN, DBL_MAX, &op->number);
+    op->i = kore_strtonum64(op->str, 1, &op->integer);
+    op->u = kore_strtonum64(op->str, 0, &op->u64);
+}
+
+int
+compare(struct kore_json_item *o, const struct operand *op)
+{
+    switch (o->type) {
+        case KORE_JSON_TYPE_NUMBER:
+            return (!op->number) ? 0 : (o->data.number > op->d) - (o->data.number < op->d);
+
+        case KORE_JSON_TYPE_INTEGER:
+            return (!op->integer) ? 0 : (o->data.integer > op->i) - (o->data.integer < op->i);
+
+        case KORE_JSON_TYPE_INTEGER_U64:
+            return (!op->u64) ? 0 : (o->data.u64 > op->u) - (o->data.u64 < op->u);
+
+        case KORE_JSON_TYPE_STRING:
+            return (strcmp(o->data.string, op->str));
+
+        default: return (0);
+    }
+}
+
+int
+evalcomp(struct closure *cl, void *o, const struct operand *op, enum comp k)
+{
+    int c, rc;
+
+    c = data_compare(cl, o, op);
+    switch (k) {
+        case C_eq: rc = (c == 0); break;
+        case C_lt: rc = (c < 0); break;
+        case C_le: rc = (c <= 0); break;
+        case C_gt: rc = (c > 0); break;
+        case C_ge: rc = (c >= 0); break;
+        default: return (0);
+    }
+    return (op->flip ? !rc : rc);
+}
+
+/*
+ * Sends the output rendered so far as a chunk of the response to cl->req,
+ * starting a chunked response on the first call. 'last' ends the response.
+ * net_send_queue() copies the chunk and the render goes on whether or not
+ * the socket took it: a render cannot be suspended, and waiting for the
+ * send queue to drain would stall every connection of the worker.
+ */
+int
+stream_flush(struct closure *cl, int last)
+{
+    struct connection   *c = cl->req->owner;
+    char                hdr[32];
+    int                 len;
+
+    if (!cl->streaming) {
+        cl->streaming = 1;
+        cl->req->flags |= HTTP_REQUEST_NO_CONTENT_LENGTH;
+        http_response_header(cl->req, "transfer-encoding", "chunked");
+        http_response(cl->req, cl->status, NULL, 0);
+    }
+
+    if (cl->result->offset > 0) {
+        len = snprintf(hdr, sizeof(hdr), "%zx\r\n", cl->result->offset);
+        net_send_queue(c, hdr, len);
+        net_send_queue(c, cl->result->data, cl->result->offset);
+        net_send_queue(c, "\r\n", 2);
+        kore_buf_reset(cl->result);
+    }
+
+    if (last)
+        net_send_queue(c, "0\r\n\r\n", 5);
+
+    return (net_send_flush(c) ? MUSTACH_OK : MUSTACH_ERROR_SYSTEM);
+}
+
+/*
+ * Appends 'len' bytes of 's' to 'buf' html escaped, copying the runs
+ * in between escapable bytes straight into the buffer.
+ */
+void
+escape_append(struct kore_buf *buf, const char *s, size_t len)
+{
+    const char  *p, *end = s + len;
+
+    while ((p = escape_scan(s, end)) < end) {
+        kore_buf_append(buf, s, p - s);
+        kore_buf_append(buf, escapes[(unsigned char)*p].str,
+            escapes[(unsigned char)*p].len);
+        s = p + 1;
+    }
+
+    kore_buf_append(buf, s, end - s);
+}
+
+/* Returns the first escapable byte in [p, end) or end if there is none. */
+const char *
+escape_scan(const char *p, const char *end)
+{
+#if defined(ESCAPE_AVX2)
+    if (end - p >= 32 && __builtin_cpu_supports("avx2"))
+        p = escape_scan_avx2(p, end);
+#endif
+#if defined(__SSE2__)
+    const __m128i   amp = _mm_set1_epi8('&'), lt = _mm_set1_epi8('<');
+    const __m128i   gt = _mm_set1_epi8('>'), quot = _mm_set1_epi8('"');
+    __m128i         v;
+    u_int32_t       m;
+
+    for (; end - p >= 16; p += 16) {
+        v = _mm_loadu_si128((const __m128i *)p);
+        m = _mm_movemask_epi8(_mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, lt)),
+            _mm_or_si128(_mm_cmpeq_epi8(v, gt), _mm_cmpeq_epi8(v, quot))));
+        if (m != 0)
+            return (p + __builtin_ctz(m));
+    }
+#endif
+
+    for (; p < end; p++) {
+        if (escapes[(unsigned char)*p].str != NULL)
+            break;
+    }
+
+    return (p);
+}
+
+#if defined(ESCAPE_AVX2)
+/*
+ * Scans [p, end) 32 bytes at a time, on cpus that have AVX2. Returns the
+ * first escapable byte, or where less than 32 bytes are left to scan.
+ */
+const char *
+escape_scan_avx2(const char *p, const char *end)
+{
+    const __m256i   amp = _mm256_set1_epi8('&'), lt = _mm256_set1_epi8('<');
+    const __m256i   gt = _mm256_set1_epi8('>'), quot = _mm256_set1_epi8('"');
+    __m256i         v;
+    u_int32_t       m;
+
+    for (; end - p >= 32; p += 32) {
+        v = _mm256_loadu_si256((const __m256i *)p);
+        m = _mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, amp), _mm256_cmpeq_epi8(v, lt)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, gt), _mm256_cmpeq_epi8(v, quot))));
+        if (m != 0)
+            return (p + __builtin_ctz(m));
+    }
+
+    return (p);
+}
+#endif
+
+/*
+ * Returns the cached file partial 'name', revalidating it if it is due.
+ * With 'load' set a partial that is not cached yet is read from disk.
+ */
+struct kore_mustach_template *
+partial_file(const char *name, int flags, int load, int *err)
+{
+    struct kore_mustach_template    *tpl = NULL;
+    struct partial                  *p;
+    u_int64_t                       now = kore_time_ms();
+    int                             fresh = 0;
+
+    pthread_rwlock_rdlock(&partial_lock);
+    if ((p = partial_entry(name, flags)) != NULL) {
+        fresh = now - p->checked < __atomic_load_n(&partial_check, __ATOMIC_RELAXED);
+        if (p->tpl != NULL) {
+            tpl = fresh ? template_ref(p->tpl) : NULL;
+            load = 1;
+        }
+    }
+    pthread_rwlock_unlock(&partial_lock);
+
+    if (fresh || !load)
+        return (tpl);
+
+    pthread_rwlock_wrlock(&partial_lock);
+    tpl = partial_update(name, flags, now, err);
+    pthread_rwlock_unlock(&partial_lock);
+
+    return (tpl);
+}
+
+/* Loads or revalidates the cache entry for 'name', with partial_lock held for writing. */
+struct kore_mustach_template *
+partial_update(const char *name, int flags, u_int64_t now, int *err)
+{
+    struct kore_mustach_template    *tpl;
+    struct partial                  *p;
+    struct stat                     st;
+
+    /* another thread may have been here first */
+    if ((p = partial_entry(name, flags)) != NULL &&
+            now - p->checked < __atomic_load_n(&partial_check, __ATOMIC_RELAXED))
+        return (p->tpl != NULL ? template_ref(p->tpl) : NULL);
+
+    if (stat(name, &st) == -1 || !S_ISREG(st.st_mode)) {
+        if (p == NULL)
+            p = partial_insert(name, flags);
+        else if (p->tpl != NULL)
+            partial_drop(p);
+        p->checked = now;
+        return (NULL);
+    }
+
+    if (p != NULL && p->tpl != NULL && p->size == st.st_size &&
+            p->mtime.tv_sec == st.st_mtim.tv_sec &&
+            p->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        p->checked = now;
+        return (template_ref(p->tpl));
+    }
+
+    if ((tpl = partial_read(name, flags, &st, err)) == NULL) {
+        if (p != NULL)
+            partial_remove(p);
+        return (NULL);
+    }
+
+    if (p == NULL)
+        p = partial_insert(name, flags);
+    else if (p->tpl != NULL)
+        template_release(p->tpl);
+
+    p->tpl = tpl;
+    p->mtime = st.st_mtim;
+    p->size = st.st_size;
+    p->checked = now;
+    __atomic_add_fetch(&partial_generation, 1, __ATOMIC_RELAXED);
+
+    return (template_ref(tpl));
+}
+
+struct kore_mustach_template *
+partial_read(const char *path, int flags, struct stat *st, int *err)
+{
+    struct kore_mustach_template    *tpl = NULL;
+    char                            *data;
+    ssize_t                         ret;
+    size_t                          len;
+    int                             fd;
+
+    if ((fd = open(path, O_RDONLY | O_NOFOLLOW)) == -1)
+        return (NULL);
+
+    if (fstat(fd, st) == -1 || !S_ISREG(st->st_mode)) {
+        close(fd);
+        return (NULL);
+    }
+
+    data = kore_malloc(st->st_size + 1);
+    for (len = 0; len < (size_t)st->st_size; len += ret) {
+        if ((ret = read(fd, data + len, st->st_size - len)) <= 0) {
+            if (ret == -1 && errno == EINTR) {
+                ret = 0;
+                continue;
+            }
+            break;
+        }
+    }
+    close(fd);
+
+    if (len == (size_t)st->st_size)
+        tpl = template_compile(data, len, flags, err);
+    else
+        *err = MUSTACH_ERROR_SYSTEM;
+
+    kore_free(data);
+    return (tpl);
+}
+
+struct partial *
+partial_entry(const char *name, int flags)
+{
+    struct partial  *p;
+    u_int32_t       hash = index_hash(NULL, name, strlen(name));
+
+    LIST_FOREACH(p, &partials[hash % PARTIAL_BUCKETS], list) {
+        if (p->hash == hash && p->flags == flags && !strcmp(p->name, name))
+            return (p);
+    }
+
+    return (NULL);
+}
+
+/* Adds an entry for 'name' without a template, with partial_lock held for writing. */
+struct partial *
+partial_insert(const char *name, int flags)
+{
+    struct partial  *p;
+
+    p = kore_calloc(1, sizeof(*p));
+    p->name = kore_strdup(name);
+    p->hash = index_hash(NULL, name, strlen(name));
+    p->flags = flags;
+    LIST_INSERT_HEAD(&partials[p->hash % PARTIAL_BUCKETS], p, list);
+
+    return (p);
+}
+
+/* Drops the template of 'p', which is no longer a file. */
+void
+partial_drop(struct partial *p)
+{
+    template_release(p->tpl);
+    p->tpl = NULL;
+    __atomic_add_fetch(&partial_generation, 1, __ATOMIC_RELAXED);
+}
+
+void
+partial_remove(struct partial *p)
+{
+    LIST_REMOVE(p, list);
+    if (p->tpl != NULL)
+        template_release(p->tpl);
+    kore_free(p->name);
+    kore_free(p);
+    __atomic_add_fetch(&partial_generation, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Renders the body of the cache section at 'pc' or copies the output it
+ * had the last time for the same value of its key. The body is rendered
+ * in the context of the section, its key is only looked up. Streaming is
+ * held off while the body renders so its output stays in the buffer.
+ */
+int
+fragment_exec(struct kore_mustach_template *tpl, struct closure *cl, size_t pc,
+        struct prefix *prefix)
+{
+    struct op                       *op = &tpl->ops[pc];
+    struct mustach_sbuf             sbuf = {};
+    struct kore_buf                 *out = cl->out;
+    struct kore_mustach_template    *sub;
+    struct prefix                   *p;
+    void                            *item;
+    char                            *value;
+    size_t                          len, start, i;
+    u_int64_t                       sig, gen, now;
+    int                             rc;
+
+    if (__atomic_load_n(&fragment_max, __ATOMIC_RELAXED) == 0 || cl->context == NULL ||
+            (item = data_in_stack(cl, op->key->segs, op->key->count)) == NULL)
+        return (template_exec(tpl, cl, pc + 1, op->jump, prefix));
+
+    /* the scratch buffer holding it is reused by the body */
+    data_tosbuf(cl, item, &sbuf);
+    len = sbuf_length(&sbuf);
+    value = arena_calloc(&cl->arena, 1, len + 1);
+    memcpy(value, sbuf.value, len);
+
+    /* indentation is part of the output */
+    for (sig = op->sig, p = prefix; p != NULL; p = p->parent)
+        sig = fragment_hash(sig, p->text, p->length);
+
+    /*
+     * The body is only signed with the names of its partials. Checking
+     * the files it uses first lets a reload move partial_generation, and
+     * the output of the body kept before it is no longer found.
+     */
+    for (i = pc + 1; i < op->jump; i++) {
+        if (tpl->ops[i].type == OP_PARTIAL &&
+                (sub = partial_file(tpl->ops[i].name, tpl->flags, 0, &rc)) != NULL)
+            template_release(sub);
+    }
+    gen = __atomic_load_n(&partial_generation, __ATOMIC_RELAXED);
+    sig = fragment_hash(sig, &gen, sizeof(gen));
+
+    now = kore_time_ms();
+    start = out->offset;
+    if (fragment_get(out, value, len, sig, now, NULL)) {
+        cl->stats.fragments++;
+        cl->stats.emitted += out->offset - start;
+    } else {
+        cl->windows++;
+        rc = template_exec(tpl, cl, pc + 1, op->jump, prefix);
+        cl->windows--;
+
+        if (rc < 0)
+            return (rc);
+
+        fragment_put(op->name + 6, value, len, sig, out->data + start,
+            out->offset - start, now, 0);
+    }
+
+    if (out == cl->result && cl->windows == 0 && cl->req != NULL &&
+            cl->result->offset >= cl->chunk)
+        return (stream_flush(cl, 0));
+
+    return (MUSTACH_OK);
+}
+
+/* Appends the cached output for 'value' and 'sig' to 'out', if there is one. */
+int
+fragment_get(struct kore_buf *out, const char *value, size_t len, u_int64_t sig,
+        u_int64_t now, u_int64_t *etag)
+{
+    struct fragment *f;
+    int             found = 0;
+
+    pthread_mutex_lock(&fragment_lock);
+    if ((f = fragment_entry(value, len, sig, fragment_hash(sig, value, len))) != NULL) {
+        if (fragment_ttl != 0 && now - f->stored >= fragment_ttl) {
+            fragment_remove(f);
+        } else {
+            TAILQ_REMOVE(&fragment_lru, f, lru);
+            TAILQ_INSERT_HEAD(&fragment_lru, f, lru);
+            kore_buf_append(out, f->data, f->length);
+            if (etag != NULL)
+                *etag = f->etag;
+            found = 1;
+        }
+    }
+    pthread_mutex_unlock(&fragment_lock);
+
+    return (found);
+}
+
+void
+fragment_put(const char *name, const char *value, size_t len, u_int64_t sig,
+        const void *data, size_t length, u_int64_t now, u_int64_t etag)
+{
+    struct fragment *f;
+    size_t          nlen = strlen(name) + 1;
+    u_int64_t       hash = fragment_hash(sig, value, len);
+
+    pthread_mutex_lock(&fragment_lock);
+    if (length + len < fragment_max) {
+        /* another render may have been here first */
+        if ((f = fragment_entry(value, len, sig, hash)) != NULL)
+            fragment_remove(f);
+
+        /* the entry, its name, value and output share one allocation */
+        f = kore_malloc(sizeof(*f) + nlen + len + 1 + length);
+        f->name = (char *)(f + 1);
+        memcpy(f->name, name, nlen);
+        f->value = f->name + nlen;
+        memcpy(f->value, value, len);
+        f->value[len] = '\0';
+        f->vlen = len;
+        f->data = (u_int8_t *)f->value + len + 1;
+        memcpy(f->data, data, length);
+        f->length = length;
+        f->etag = etag;
+        f->sig = sig;
+        f->hash = hash;
+        f->stored = now;
+
+        LIST_INSERT_HEAD(&fragments[hash % FRAGMENT_BUCKETS], f, list);
+        TAILQ_INSERT_HEAD(&fragment_lru, f, lru);
+        fragment_bytes += length + len;
+        fragment_trim(fragment_max);
+    }
+    pthread_mutex_unlock(&fragment_lock);
+}
+
+/* With fragment_lock held. */
+struct fragment *
+fragment_entry(const char *value, size_t len, u_int64_t sig, u_int64_t hash)
+{
+    struct fragment *f;
+
+    LIST_FOREACH(f, &fragments[hash % FRAGMENT_BUCKETS], list) {
+        if (f->hash == hash && f->sig == sig && f->vlen == len &&
+                !memcmp(f->value, value, len))
+            return (f);
+    }
+
+    return (NULL);
+}
+
+void
+fragment_remove(struct fragment *f)
+{
+    LIST_REMOVE(f, list);
+    TAILQ_REMOVE(&fragment_lru, f, lru);
+    fragment_bytes -= f->length + f->vlen;
+    kore_free(f);
+}
+
+/* Drops the least recently used entries until at most 'max' bytes are left. */
+void
+fragment_trim(size_t max)
+{
+    while (fragment_bytes > max)
+        fragment_remove(TAILQ_LAST(&fragment_lru, fragment_lru_head));
+}
+
+u_int64_t
+fragment_hash(u_int64_t h, const void *data, size_t len)
+{
+    const u_int8_t  *p = data;
+    size_t          i;
+
+    if (h == 0)
+        h = 14695981039346656037ULL;
+
+    for (i = 0; i < len; i++)
+        h = (h ^ p[i]) * 1099511628211ULL;
+
+    return (h);
+}
+
+/*
+ * Identifies a render of 'template' on 'json' for the output cache. The
+ * signature covers the template, its flags and the file partials as they
+ * are, by partial_generation, which only means something to this process
+ * and its cache. 'key' receives the data flattened.
+ */
+u_int64_t
+output_key(const char *template, int flags, struct kore_json_item *json,
+        struct kore_buf *key)
+{
+    u_int64_t   sig, gen;
+
+    gen = __atomic_load_n(&partial_generation, __ATOMIC_RELAXED);
+    sig = fragment_hash(0, &flags, sizeof(flags));
+    sig = fragment_hash(sig, &gen, sizeof(gen));
+    sig = fragment_hash(sig, template, strlen(template));
+
+    if (json != NULL)
+        json_flatten(key, json);
+
+    return (sig);
+}
+
+/*
+ * Copies the cached output for 'key' and 'sig', or renders and caches it.
+ * 'etag' receives the hash of the output, which unlike 'sig' is the same
+ * in every process that renders it.
+ */
+int
+output_render(const char *template, struct kore_json_item *json, int flags,
+        struct kore_buf *key, u_int64_t sig, struct kore_buf **result, u_int64_t *etag)
+{
+    u_int64_t   now = kore_time_ms();
+
+    *result = kore_buf_alloc(RESULT_SIZE);
+    if (fragment_get(*result, (const char *)key->data, key->offset, sig, now, etag)) {
+        mustach_errno = MUSTACH_OK;
+        return (KORE_RESULT_OK);
+    }
+
+    kore_buf_free(*result);
+    if (!kore_mustach_json(template, json, flags, result))
+        return (KORE_RESULT_ERROR);
+
+    *etag = fragment_hash(0, (*result)->data, (*result)->offset);
+    fragment_put("", (const char *)key->data, key->offset, sig, (*result)->data,
+        (*result)->offset, now, *etag);
+
+    return (KORE_RESULT_OK);
+}
+
+/*
+ * Appends 'o' to 'buf' as its types, names and values are in memory, each
+ * container closed by a zero type, so two trees only flatten the same way
+ * when they hold the same data.
+ */
+void
+json_flatten(struct kore_buf *buf, struct kore_json_item *o)
+{
+    struct kore_json_item   *item;
+    u_int32_t               end = 0;
+
+    kore_buf_append(buf, &o->type, sizeof(o->type));
+    if (o->name != NULL)
+        kore_buf_append(buf, o->name, strlen(o->name) + 1);
+    else
+        kore_buf_append(buf, "", 1);
+
+    switch (o->type) {
+    case KORE_JSON_TYPE_OBJECT:
+    case KORE_JSON_TYPE_ARRAY:
+        TAILQ_FOREACH(item, &o->data.items, list)
+            json_flatten(buf, item);
+        kore_buf_append(buf, &end, sizeof(end));
+        break;
+
+    case KORE_JSON_TYPE_STRING:
+        kore_buf_append(buf, o->data.string, strlen(o->data.string) + 1);
+        break;
+
+    case KORE_JSON_TYPE_LITERAL:
+        kore_buf_append(buf, &o->data.literal, sizeof(o->data.literal));
+        break;
+
+    default:
+        /* numbers, whichever their type, take 8 bytes */
+        kore_buf_append(buf, &o->data, sizeof(u_int64_t));
+        break;
+    }
+}
+
+void
+etag_format(char *etag, u_int64_t hash)
+{
+    snprintf(etag, KORE_MUSTACH_ETAG_LEN, "\"%016" PRIx64 "\"", hash);
+}
+
+/*
+ * Whether the If-None-Match 'list' is "*" or one of its entity tags is
+ * 'etag', compared whole once a W/ prefix is dropped. Entries that are not
+ * quoted are skipped.
+ */
+int
+etag_match(const char *list, const char *etag)
+{
+    const char  *p = list, *end;
+    size_t      len = strlen(etag);
+
+    for (;;) {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+
+        if (*p == '\0')
+            return (0);
+
+        if (*p == '*')
+            return (1);
+
+        if (!strncmp(p, "W/", 2))
+            p += 2;
+
+        if (*p != '"') {
+            while (*p != '\0' && *p != ',')
+                p++;
+            continue;
+        }
+
+        if ((end = strchr(p + 1, '"')) == NULL)
+            return (0);
+
+        if ((size_t)(end + 1 - p) == len && !memcmp(p, etag, len))
+            return (1);
+
+        p = end + 1;
+    }
+}
+
+/*
+ * Renders the list section entered at 'pc' on the thread pool if it has at
+ * least parallel_min items, then leaves it. Returns 0 when it is left to
+ * the caller to render, 1 when done or the error of the first chunk that
+ * failed, in the order of the list.
+ */
+int
+parallel_exec(struct kore_mustach_template *tpl, struct closure *cl, size_t pc,
+        struct prefix *prefix)
+{
+    struct kore_mustach_ctx *ctx;
+    struct stack            *top = &cl->stack[cl->depth];
+    struct parallel         job = {};
+    void                    *item;
+    size_t                  i, n, parts, min;
+    int                     rc = MUSTACH_OK;
+
+    /*
+     * Pool threads allocate from kore, which needs tasks for that, and
+     * providers, lazy json included, may not be read from several threads.
+     */
+    if (!PARALLEL_TASKS || cl->provider != NULL ||
+            __atomic_load_n(&parallel_max, __ATOMIC_RELAXED) == 0)
+        return (0);
+
+    min = __atomic_load_n(&parallel_min, __ATOMIC_RELAXED);
+    for (item = cl->context, n = 0; item != NULL && n < min; n++)
+        item = data_next(cl, top->list, item);
+
+    if (n < min)
+        return (0);
+
+    for (; item != NULL; n++)
+        item = data_next(cl, top->list, item);
+
+    job.tpl = tpl;
+    job.pc = pc;
+    job.prefix = prefix;
+    job.cl = cl;
+    job.count = n;
+    job.items = kore_calloc(n, sizeof(*job.items));
+    for (item = cl->context, n = 0; item != NULL; n++) {
+        job.items[n] = item;
+        item = data_next(cl, top->list, item);
+    }
+
+    /* the render helps the pool threads */
+    parts = (__atomic_load_n(&parallel_max, __ATOMIC_RELAXED) + 1) * PARALLEL_CHUNKS;
+    job.size = (job.count + parts - 1) / parts;
+    job.chunks = (job.count + job.size - 1) / job.size;
+    job.out = kore_calloc(job.chunks, sizeof(*job.out));
+    job.rc = kore_calloc(job.chunks, sizeof(*job.rc));
+
+    ctx = ctx_get();
+    pthread_mutex_lock(&parallel_lock);
+    parallel_start();
+    TAILQ_INSERT_TAIL(&parallel_jobs, &job, list);
+    pthread_cond_broadcast(&parallel_work);
+
+    for (i = 0; i < job.chunks; i++) {
+        while (job.out[i] == NULL) {
+            if (job.next < job.chunks) {
+                n = parallel_take(&job);
+                pthread_mutex_unlock(&parallel_lock);
+                parallel_chunk(&job, n, &ctx->cl);
+                pthread_mutex_lock(&parallel_lock);
+            } else {
+                pthread_cond_wait(&parallel_done, &parallel_lock);
+            }
+        }
+        pthread_mutex_unlock(&parallel_lock);
+
+        if (rc == MUSTACH_OK && (rc = job.rc[i]) == MUSTACH_OK) {
+            kore_buf_append(cl->out, job.out[i]->data, job.out[i]->offset);
+            if (cl->out == cl->result && cl->windows == 0 && cl->req != NULL &&
+                    cl->result->offset >= cl->chunk)
+                rc = stream_flush(cl, 0);
+        }
+        kore_buf_free(job.out[i]);
+
+        pthread_mutex_lock(&parallel_lock);
+
+        /* after an error only the chunks already taken are waited for */
+        if (rc != MUSTACH_OK && job.next < job.chunks) {
+            TAILQ_REMOVE(&parallel_jobs, &job, list);
+            job.chunks = job.next;
+        }
+    }
+    pthread_mutex_unlock(&parallel_lock);
+    ctx_put(ctx);
+
+    kore_free(job.items);
+    kore_free(job.out);
+    kore_free(job.rc);
+
+    if (rc != MUSTACH_OK)
+        return (rc);
+
+    /* every counter adds up, elapsed is only set at the end of a render */
+    for (i = 0; i < sizeof(job.stats) / sizeof(u_int64_t); i++)
+        ((u_int64_t *)&cl->stats)[i] += ((u_int64_t *)&job.stats)[i];
+    cl->stats.iterations += job.count - 1;
+
+    leave(cl);
+    return (1);
+}
+
+/* Hands out the next chunk of 'job', with parallel_lock held. */
+size_t
+parallel_take(struct parallel *job)
+{
+    if (job->next + 1 == job->chunks)
+        TAILQ_REMOVE(&parallel_jobs, job, list);
+
+    return (job->next++);
+}
+
+/*
+ * Renders chunk 'n' of 'job' on 'wcl', which stands in the section with
+ * a copy of the context stack of the render, then hands its output over.
+ */
+void
+parallel_chunk(struct parallel *job, size_t n, struct closure *wcl)
+{
+    struct closure  *cl = job->cl, *prev = current;
+    size_t          i, first, end;
+    int             rc = MUSTACH_OK;
+
+    closure_init(wcl, NULL, cl->flags & ~Mustach_With_ParallelSections);
+    memset(&wcl->stats, 0, sizeof(wcl->stats));
+    if (wcl->scratch.data == NULL)
+        kore_buf_init(&wcl->scratch, 64);
+
+    wcl->result = kore_buf_alloc(RESULT_SIZE);
+    wcl->out = wcl->result;
+    wcl->stats.allocs++;
+    wcl->depth = cl->depth;
+    memcpy(wcl->stack, cl->stack, (cl->depth + 1) * sizeof(cl->stack[0]));
+    current = wcl;
+
+    first = n * job->size;
+    end = first + job->size < job->count ? first + job->size : job->count;
+    for (i = first; i < end && rc == MUSTACH_OK; i++) {
+        /* room for another item the size of the ones before */
+        if (i > first)
+            buf_reserve(wcl->result, wcl->result->offset / (i - first));
+
+        wcl->context = job->items[i];
+        rc = template_exec(job->tpl, wcl, job->pc + 1, job->tpl->ops[job->pc].jump,
+            job->prefix);
+    }
+
+    /* lambda sections an error left open, the frames below are the render's */
+    for (; wcl->depth > cl->depth; wcl->depth--) {
+        if (wcl->stack[wcl->depth].buf != NULL)
+            buf_put(wcl, wcl->stack[wcl->depth].buf);
+    }
+
+    index_cleanup(&wcl->index);
+    arena_reset(&wcl->arena);
+    wcl->context = NULL;
+    current = prev;
+
+    pthread_mutex_lock(&parallel_lock);
+    job->out[n] = wcl->result;
+    job->rc[n] = rc;
+    for (i = 0; i < sizeof(job->stats) / sizeof(u_int64_t); i++)
+        ((u_int64_t *)&job->stats)[i] += ((u_int64_t *)&wcl->stats)[i];
+    pthread_cond_broadcast(&parallel_done);
+    pthread_mutex_unlock(&parallel_lock);
+
+    wcl->result = NULL;
+    wcl->out = NULL;
+}
+
+/*
+ * Starts pool threads up to parallel_max, with parallel_lock held. They
+ * are started by the first render needing them, in the worker process.
+ */
+void
+parallel_start(void)
+{
+    pthread_t   tid;
+    sigset_t    all, old;
+    int         rc;
+
+    /* signals are left to the thread of the worker */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    while (parallel_threads < parallel_max) {
+        if ((rc = pthread_create(&tid, NULL, parallel_main, NULL)) != 0) {
+            kore_log(LOG_NOTICE, "kore_mustach: cannot start pool thread: %s",
+                strerror(rc));
+            __atomic_store_n(&parallel_max, parallel_threads, __ATOMIC_RELAXED);
+            break;
+        }
+        pthread_detach(tid);
+        parallel_threads++;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+void *
+parallel_main(void *arg)
+{
+    struct kore_mustach_ctx *ctx = kore_mustach_ctx_alloc();
+    struct parallel         *job;
+    size_t                  n;
+
+    (void)arg;
+
+    pthread_mutex_lock(&parallel_lock);
+    for (;;) {
+        if ((job = TAILQ_FIRST(&parallel_jobs)) == NULL) {
+            pthread_cond_wait(&parallel_work, &parallel_lock);
+            continue;
+        }
+
+        n = parallel_take(job);
+        pthread_mutex_unlock(&parallel_lock);
+        parallel_chunk(job, n, &ctx->cl);
+        pthread_mutex_lock(&parallel_lock);
+    }
+
+    return (NULL);
+}
+
+u_int32_t
+index_hash(struct kore_json_item *parent, const char *name, size_t len)
+{
+    u_int64_t   h = 14695981039346656037ULL ^ (uintptr_t)parent;
+    size_t      i;
+
+    for (i = 0; i < len; i++)
+        h = (h ^ (unsigned char)name[i]) * 1099511628211ULL;
+
+    return ((u_int32_t)(h ^ (h >> 32)));
+}
+
+/* Returns the entry for the key or the empty slot where it belongs. */
+struct index_entry *
+index_slot(struct index *idx, struct kore_json_item *parent, const char *name,
+        size_t len, u_int32_t hash)
+{
+    struct index_entry  *e;
+    size_t              i;
+
+    for (i = hash & (idx->size - 1);; i = (i + 1) & (idx->size - 1)) {
+        e = &idx->entries[i];
+
+        if (e->parent == NULL)
+            return (e);
+
+        if (e->parent == parent && e->hash == hash && e->len == len &&
+                (name == NULL ? e->name == NULL :
+                 e->name != NULL && !memcmp(e->name, name, len)))
+            return (e);
+    }
+}
+
+void
+index_grow(struct index *idx)
+{
+    struct index_entry  *old = idx->entries;
+    size_t              i, size = idx->size;
+
+    idx->size = size ? size * 2 : 64;
+    idx->entries = arena_calloc(idx->arena, idx->size, sizeof(*idx->entries));
+
+    for (i = 0; i < size; i++) {
+        if (old[i].parent != NULL)
+            *index_slot(idx, old[i].parent, old[i].name, old[i].len, old[i].hash) = old[i];
+    }
+}
+
+void
+index_insert(struct index *idx, struct kore_json_item *parent, const char *name,
+        size_t len, struct kore_json_item *item)
+{
+    struct index_entry  *e;
+    u_int32_t           hash;
+
+    if ((idx->count + 1) * 10 >= idx->size * 7)
+        index_grow(idx);
+
+    hash = index_hash(parent, name, len);
+    e = index_slot(idx, parent, name, len, hash);
+
+    /* like a list scan, the first member of a given name wins */
+    if (e->parent != NULL)
+        return;
+
+    *e = (struct index_entry){ parent, item, name, len, hash };
+    idx->count++;
+}
+
+void
+index_object(struct index *idx, struct kore_json_item *o)
+{
+    struct kore_json_item   *item;
+    size_t                  n = 0;
+
+    TAILQ_FOREACH(item, &o->data.items, list)
+        n++;
+
+    if (n < INDEX_MIN_ITEMS) {
+        index_insert(idx, o, NULL, 0, NULL);
+        return;
+    }
+
+    index_insert(idx, o, NULL, 0, o);
+    TAILQ_FOREACH(item, &o->data.items, list) {
+        if (item->name != NULL)
+            index_insert(idx, o, item->name, strlen(item->name), item);
+    }
+}
+
+void
+index_cleanup(struct index *idx)
+{
+    /* the entries go with the render's arena */
+    idx->entries = NULL;
+    idx->size = idx->count = 0;
+}
+
+void *
+arena_calloc(struct arena *a, size_t n, size_t size)
+{
+    struct arena_block  *b = a->head;
+    size_t              len = (n * size + 15) & ~(size_t)15;
+    void                *p;
+
+    if (b == NULL || b->size - b->used < len) {
+        b = kore_malloc(sizeof(*b) + (len > ARENA_BLOCK ? len : ARENA_BLOCK));
+        a->blocks++;
+        b->size = len > ARENA_BLOCK ? len : ARENA_BLOCK;
+        b->used = 0;
+        b->next = a->head;
+        a->head = b;
+    }
+
+    p = b->data + b->used;
+    b->used += len;
+    memset(p, 0, len);
+
+    return (p);
+}
+
+void
+arena_reset(struct arena *a)
+{
+    struct arena_block  *b;
+    size_t              total = 0;
+
+    if (a->head == NULL)
+        return;
+
+    if (a->head->next == NULL) {
+        a->head->used = 0;
+        return;
+    }
+
+    /* the next render gets a single block as large as this one used */
+    for (b = a->head; b != NULL; b = b->next)
+        total += b->size;
+
+    arena_free(a);
+    arena_calloc(a, total, 1);
+    a->head->used = 0;
+}
+
+void
+arena_free(struct arena *a)
+{
+    struct arena_block  *b;
+
+    while ((b = a->head) != NULL) {
+        a->head = b->next;
+        kore_free(b);
+    }
+}
+
+/*
+ * Returns the cache entry for 'name', adding an empty one if there is none
+ * and 'create' is set. The caller holds lambda_lock, for writing to create.
+ */
+struct lambda *
+lambda_entry(const char *name, int create)
+{
+    struct lambda   *l;
+    size_t          len = strlen(name);
+    u_int32_t       hash = index_hash(NULL, name, len);
+
+    LIST_FOREACH(l, &lambdas[hash % LAMBDA_BUCKETS], list) {
+        if (l->hash == hash && !strcmp(l->name, name))
+            return (l);
+    }
+
+    if (!create)
+        return (NULL);
+
+    l = kore_calloc(1, sizeof(*l));
+    l->name = kore_strdup(name);
+    l->hash = hash;
+    LIST_INSERT_HEAD(&lambdas[hash % LAMBDA_BUCKETS], l, list);
+
+    return (l);
+}
+
+/* Returns the lambda called 'name', resolving it through dlsym(3) only once. */
+struct lambda *
+lambda_find(const char *name)
+{
+    struct kore_runtime_call    *rcall;
+    struct lambda               *l;
+
+    pthread_rwlock_rdlock(&lambda_lock);
+    if ((l = lambda_entry(name, 0)) != NULL && !l->resolved)
+        l = NULL;
+    pthread_rwlock_unlock(&lambda_lock);
+
+    if (l == NULL) {
+        pthread_rwlock_wrlock(&lambda_lock);
+        l = lambda_entry(name, 1);
+        if (!l->resolved) {
+            if ((rcall = kore_runtime_getcall(name)) != NULL) {
+                *(void **)&(l->cb) = rcall->addr;
+                kore_free(rcall);
+            }
+            l->resolved = 1;
+        }
+        pthread_rwlock_unlock(&lambda_lock);
+    }
+
+    return (l->cb != NULL || l->cb_ctx != NULL || l->cb_inplace != NULL ? l : NULL);
+}
+
+/* Every closure is the first member of a kore_mustach_ctx. */
+void
+lambda_call(struct lambda *l, struct closure *cl, struct kore_buf *buf, size_t offset)
+{
+    cl->stats.lambdas++;
+
+    if (l->cb_inplace != NULL)
+        l->cb_inplace((struct kore_mustach_ctx *)cl, buf, offset);
+    else if (l->cb_ctx != NULL)
+        l->cb_ctx((struct kore_mustach_ctx *)cl, buf);
+    else
+        l->cb(buf);
+}
+
+struct kore_mustach_template *
+template_compile(const char *text, size_t length, int flags, int *err)
+{
+    struct kore_mustach_template    *tpl;
+
+    tpl = kore_calloc(1, sizeof(*tpl));
+    tpl->text = kore_malloc(length + 1);
+    memcpy(tpl->text, text, length);
+    tpl->text[length] = '\0';
+    tpl->length = length;
+    tpl->flags = flags;
+    tpl->refs = 1;
+
+    if ((*err = template_tokenize(tpl)) == MUSTACH_OK) {
+        template_standalone(tpl);
+        *err = template_link(tpl);
+    }
+
+    if (*err != MUSTACH_OK) {
+        kore_mustach_template_free(tpl);
+        return (NULL);
+    }
+
+    return (tpl);
+}
+
+int
+template_tokenize(struct kore_mustach_template *tpl)
+{
+    const char  *opstr = "{{", *clstr = "}}";
+    const char  *p, *beg, *term, *end;
+    size_t      oplen = 2, cllen = 2, len, l;
+    struct op   *op;
+    int         c;
+
+    end = tpl->text + tpl->length;
+
+    for (p = tpl->text;;) {
+        if ((beg = memmem(p, end - p, opstr, oplen)) == NULL) {
+            template_text(tpl, p, end - p);
+            return (MUSTACH_OK);
+        }
+
+        template_text(tpl, p, beg - p);
+        beg += oplen;
+
+        if ((term = memmem(beg, end - beg, clstr, cllen)) == NULL)
+            return (MUSTACH_ERROR_UNEXPECTED_END);
+
+        p = term + cllen;
+        len = term - beg;
+        c = len ? *beg : '\0';
+
+        switch (c) {
+            case '!':
+                template_op(tpl, OP_NONE, NULL, 0);
+                continue;
+
+            case '=':
+                if (len < 5 || beg[len - 1] != '=')
+                    return (MUSTACH_ERROR_BAD_SEPARATORS);
+
+                beg++;
+                len -= 2;
+                while (len && isspace((unsigned char)beg[0])) {
+                    beg++;
+                    len--;
+                }
+                while (len && isspace((unsigned char)beg[len - 1]))
+                    len--;
+
+                for (l = 0; l < len && !isspace((unsigned char)beg[l]); l++);
+                if (l == len)
+                    return (MUSTACH_ERROR_BAD_SEPARATORS);
+
+                opstr = beg;
+                oplen = l;
+
+                while (l < len && isspace((unsigned char)beg[l])) l++;
+                if (l == len)
+                    return (MUSTACH_ERROR_BAD_SEPARATORS);
+
+                clstr = beg + l;
+                cllen = len - l;
+
+                template_op(tpl, OP_NONE, NULL, 0);
+                continue;
+
+            case '{':
+                for (l = 0; l < cllen && clstr[l] == '}'; l++);
+                if (l < cllen) {
+                    if (beg[len - 1] != '}')
+                        return (MUSTACH_ERROR_BAD_UNESCAPE_TAG);
+                    len--;
+                } else {
+                    if (p == end || *p != '}')
+                        return (MUSTACH_ERROR_BAD_UNESCAPE_TAG);
+                    p++;
+                }
+                c = '&';
+                /* FALLTHROUGH */
+            case '&':
+            case '^':
+            case '#':
+            case '/':
+            case '>':
+                beg++;
+                len--;
+                break;
+
+            case ':':
+                if (tpl->flags & Mustach_With_Colon) {
+                    beg++;
+                    len--;
+                }
+                break;
+        }
+
+        while (len && isspace((unsigned char)beg[0])) {
+            beg++;
+            len--;
+        }
+        while (len && isspace((unsigned char)beg[len - 1]))
+            len--;
+
+        if (len == 0 && !(tpl->flags & Mustach_With_EmptyTag))
+            return (MUSTACH_ERROR_EMPTY_TAG);
+
+        if (len > MUSTACH_MAX_LENGTH)
+            return (MUSTACH_ERROR_TAG_TOO_LONG);
+
+        switch (c) {
+            case '^':
+            case '#':
+                op = template_op(tpl, OP_SECTION, beg, len);
+                op->flag = (c == '^');
+                break;
+
+            case '/':
+                template_op(tpl, OP_CLOSE, beg, len);
+                break;
+
+            case '>':
+                template_op(tpl, OP_PARTIAL, beg, len);
+                break;
+
+            default:
+                op = template_op(tpl, OP_PUT, beg, len);
+                op->flag = (c != '&');
+                break;
+        }
+    }
+}
+
+void
+template_text(struct kore_mustach_template *tpl, const char *text, size_t length)
+{
+    struct op   *op;
+    const char  *nl;
+    size_t      len;
+
+    while (length > 0) {
+        if ((nl = memchr(text, '\n', length)) != NULL)
+            len = nl - text + 1;
+        else
+            len = length;
+
+        op = template_op(tpl, OP_TEXT, NULL, 0);
+        op->text = text;
+        op->length = len;
+
+        text += len;
+        length -= len;
+    }
+}
+
+struct op *
+template_op(struct kore_mustach_template *tpl, enum opcode type,
+        const char *name, size_t len)
+{
+    struct op   *op;
+
+    if (tpl->count == tpl->size) {
+        tpl->size = tpl->size ? tpl->size * 2 : 32;
+        tpl->ops = kore_realloc(tpl->ops, tpl->size * sizeof(*tpl->ops));
+    }
+
+    op = &tpl->ops[tpl->count++];
+    *op = (struct op){ .type = type };
+
+    if (name != NULL) {
+        op->name = kore_malloc(len + 1);
+        memcpy(op->name, name, len);
+        op->name[len] = '\0';
+    }
+
+    if (type == OP_PUT || type == OP_SECTION)
+        op->key = key_parse(op->name, tpl->flags);
+
+    return (op);
+}
+
+/*
+ * A line holding only whitespace and section, partial, comment or
+ * delimiter tags is standalone and leaves nothing behind in the output.
+ * The whitespace in front of a standalone partial becomes its indentation,
+ * which is applied to every line marked as the beginning of a line.
+ */
+void
+template_standalone(struct kore_mustach_template *tpl)
+{
+    struct op   *line, *op, *p, *end = tpl->ops + tpl->count;
+    int         blank, tags;
+    size_t      i;
+
+    for (line = tpl->ops; line < end; line = op) {
+        blank = 1;
+        tags = 0;
+
+        for (op = line; op < end; op++) {
+            if (op->type == OP_TEXT) {
+                for (i = 0; i < op->length && blank; i++)
+                    blank = isspace((unsigned char)op->text[i]);
+
+                if (op->text[op->length - 1] == '\n') {
+                    op++;
+                    break;
+                }
+            } else if (op->type == OP_PUT) {
+                blank = 0;
+            } else {
+                tags++;
+            }
+        }
+
+        if (blank && tags) {
+            for (p = line + 1; p < op; p++) {
+                if (p->type == OP_PARTIAL && p[-1].type == OP_TEXT) {
+                    p->text = p[-1].text;
+                    p->length = p[-1].length;
+                }
+            }
+            for (p = line; p < op; p++) {
+                if (p->type == OP_TEXT)
+                    p->type = OP_NONE;
+            }
+        } else if (op - line > 1 || line->type != OP_TEXT || line->length > 1) {
+            line->bol = 1;
+        }
+    }
+}
+
+int
+template_link(struct kore_mustach_template *tpl)
+{
+    struct op   *ops, *op;
+    size_t      stack[MUSTACH_MAX_DEPTH], depth, i, n;
+    int         rc = MUSTACH_OK;
+
+    ops = kore_calloc(tpl->count * 2 + 1, sizeof(*ops));
+
+    for (i = 0, n = 0, depth = 0; i < tpl->count && rc == MUSTACH_OK; i++) {
+        op = &tpl->ops[i];
+
+        if (op->bol)
+            ops[n++] = (struct op){ .type = OP_INDENT };
+
+        switch (op->type) {
+            case OP_NONE:
+                continue;
+
+            case OP_SECTION:
+                if (depth == MUSTACH_MAX_DEPTH) {
+                    rc = MUSTACH_ERROR_TOO_DEEP;
+                    continue;
+                }
+                stack[depth++] = n;
+                break;
+
+            case OP_CLOSE:
+                if (depth == 0 || strcmp(ops[stack[depth - 1]].name, op->name)) {
+                    rc = MUSTACH_ERROR_CLOSING;
+                    continue;
+                }
+                op->jump = stack[--depth];
+                op->flag = ops[op->jump].flag;
+                ops[op->jump].jump = n;
+                break;
+
+            default:
+                break;
+        }
+
+        ops[n] = *op;
+        ops[n++].bol = 0;
+    }
+
+    if (rc == MUSTACH_OK && depth != 0)
+        rc = MUSTACH_ERROR_UNEXPECTED_END;
+
+    if (rc != MUSTACH_OK) {
+        kore_free(ops);
+        return (rc);
+    }
+
+    /* names and keys are now owned by the linked program */
+    kore_free(tpl->ops);
+    tpl->ops = ops;
+    tpl->count = tpl->size = n;
+    template_sign(tpl);
+
+    return (MUSTACH_OK);
+}
+
+/*
+ * Signs the body of each cache section with its key, flags, ops and text,
+ * so sections only share cached output when they render the same way.
+ */
+void
+template_sign(struct kore_mustach_template *tpl)
+{
+    struct op   *op, *body;
+    u_int64_t   sig;
+
+    for (op = tpl->ops; op < tpl->ops + tpl->count; op++) {
+        if (op->type != OP_SECTION || !op->key->cache)
+            continue;
+
+        sig = fragment_hash(0, &tpl->flags, sizeof(tpl->flags));
+        sig = fragment_hash(sig, op->name, strlen(op->name));
+
+        for (body = op + 1; body < tpl->ops + op->jump; body++) {
+            sig = fragment_hash(sig, &body->type, sizeof(body->type));
+            sig = fragment_hash(sig, &body->flag, sizeof(body->flag));
+            if (body->name != NULL)
+                sig = fragment_hash(sig, body->name, strlen(body->name) + 1);
+            if (body->text != NULL) {
+                sig = fragment_hash(sig, &body->length, sizeof(body->length));
+                sig = fragment_hash(sig, body->text, body->length);
+            }
+        }
+
+        op->sig = sig;
+    }
+}
+
+/* Runs the ops [begin, end) of 'tpl', a whole template or a section body. */
+int
+template_exec(struct kore_mustach_template *tpl, struct closure *cl, size_t begin,
+        size_t end, struct prefix *prefix)
+{
+    struct kore_mustach_template    *sub;
+    struct mustach_sbuf             sbuf;
+    struct prefix                   pref;
+    struct op                       *op;
+    size_t                          pc, len;
+    int                             rc;
+
+    for (pc = begin, rc = MUSTACH_OK; pc < end && rc >= 0; pc++) {
+        op = &tpl->ops[pc];
+
+        switch (op->type) {
+            case OP_TEXT:
+                rc = emit_held(cl, op->text, op->length, 0);
+                break;
+
+            case OP_INDENT:
+                rc = prefix_emit(cl, prefix);
+                break;
+
+            case OP_PUT:
+                cl->stats.tags++;
+                sbuf = (struct mustach_sbuf){};
+                if ((rc = get(cl, op->key, &sbuf)) >= 0) {
+                    if ((len = sbuf_length(&sbuf)) > 0 && cl->held &&
+                            cl->segments != NULL && cl->segments->borrow)
+                        rc = emit_held(cl, sbuf.value, len, op->flag);
+                    else if (len > 0)
+                        rc = emit(cl, sbuf.value, len, op->flag, NULL);
+                    sbuf_release(&sbuf);
+                }
+                break;
+
+            case OP_SECTION:
+                if (op->key->cache && !op->flag) {
+                    rc = fragment_exec(tpl, cl, pc, prefix);
+                    pc = op->jump;
+                    break;
+                }
+
+                if ((rc = enter(cl, op->key)) < 0)
+                    break;
+
+                /* an entered inverted section is left right away */
+                if (op->flag && rc > 0)
+                    leave(cl);
+
+                if (op->flag == (rc > 0)) {
+                    pc = op->jump;
+                } else {
+                    cl->stats.sections++;
+                    /* a long list may be rendered by the pool, and left */
+                    if ((cl->flags & Mustach_With_ParallelSections) &&
+                            cl->stack[cl->depth].iterate &&
+                            (rc = parallel_exec(tpl, cl, pc, prefix)) > 0)
+                        pc = op->jump;
+                }
+                break;
+
+            case OP_CLOSE:
+                if (op->flag)
+                    break;
+
+                if ((rc = next(cl)) > 0) {
+                    cl->stats.iterations++;
+                    pc = op->jump;
+                }
+                else if (rc == 0)
+                    leave(cl);
+                break;
+
+            case OP_PARTIAL:
+                if (prefix != NULL && prefix->depth == MUSTACH_MAX_DEPTH) {
+                    rc = MUSTACH_ERROR_TOO_DEEP;
+                    break;
+                }
+
+                if ((sub = partial(cl, op->name, tpl->flags, &rc)) != NULL) {
+                    pref = (struct prefix){ op->text, op->length,
+                        prefix != NULL ? prefix->depth + 1 : 1, prefix };
+                    rc = template_exec(sub, cl, 0, sub->count, &pref);
+                    /* segmented output may point into the partial's text */
+                    if (cl->segments != NULL)
+                        segments_hold(cl->segments, sub);
+                    else
+                        template_release(sub);
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    return (rc < 0 ? rc : MUSTACH_OK);
+}
+
+int
+template_render(struct kore_mustach_template *tpl, struct closure *cl)
+{
+    struct closure  *prev = current;
+    struct timespec ts;
+    u_int64_t       begin, blocks = cl->arena.blocks;
+    size_t          base = cl->result != NULL ? cl->result->offset : 0;
+    int             rc;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    begin = (u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    memset(&cl->stats, 0, sizeof(cl->stats));
+
+    cl->presize = template_presize(tpl);
+
+    /* a streamed result never holds much more than a chunk */
+    if (cl->req != NULL && cl->presize > cl->chunk)
+        cl->presize = cl->chunk;
+
+    /* a lambda may render another template, put the outer render back */
+    current = cl;
+    if ((rc = start(cl)) == MUSTACH_OK)
+        rc = template_exec(tpl, cl, 0, tpl->count, NULL);
+
+    /* segmented output only copies part of the page */
+    if (rc == MUSTACH_OK && !cl->streaming && cl->segments == NULL)
+        template_learn(tpl, cl->result->offset - base);
+
+    /* lambda sections an error left open */
+    for (; cl->depth > 0; cl->depth--) {
+        if (cl->stack[cl->depth].buf != NULL)
+            buf_put(cl, cl->stack[cl->depth].buf);
+    }
+
+    cl->stats.allocs += cl->arena.blocks - blocks;
+    index_cleanup(&cl->index);
+    arena_reset(&cl->arena);
+    cl->context = NULL;
+    current = prev;
+
+    template_stats(cl, begin);
+    return (rc);
+}
+
+/* Completes the stats of a render begun at 'begin' and logs it if slow. */
+void
+template_stats(struct closure *cl, u_int64_t begin)
+{
+    struct kore_mustach_stats   *st = &cl->stats;
+    struct timespec             ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    st->elapsed = (u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec - begin;
+
+    if (stats_threshold == 0 || st->elapsed / 1000 < stats_threshold)
+        return;
+
+    kore_log(LOG_NOTICE, "kore_mustach: render took %" PRIu64 "us: "
+        "%" PRIu64 " tags, %" PRIu64 " sections, %" PRIu64 " iterations, "
+        "%" PRIu64 " lookups (%" PRIu64 " missed, %" PRIu64 " frames), "
+        "%" PRIu64 " partials, %" PRIu64 " lambdas, %" PRIu64 " cached, "
+        "%" PRIu64 " bytes (%" PRIu64 " escaped), %" PRIu64 " allocations",
+        st->elapsed / 1000, st->tags, st->sections, st->iterations,
+        st->lookups, st->misses, st->frames, st->partials, st->lambdas,
+        st->fragments, st->emitted, st->escaped, st->allocs);
+}
+
+/*
+ * The result buffer of a render starts out as large as the template's
+ * renders tend to be, so it is not grown by copying as output comes in:
+ * the larger of the hint and the estimate, plus an eighth of slack.
+ */
+size_t
+template_presize(struct kore_mustach_template *tpl)
+{
+    size_t  size = __atomic_load_n(&tpl->estimate, __ATOMIC_RELAXED);
+
+    if (size < tpl->hint)
+        size = tpl->hint;
+
+    size += size / 8;
+    return (size > RESULT_SIZE ? size : RESULT_SIZE);
+}
+
+/*
+ * The estimate follows the largest output right away and decays by an
+ * eighth of the difference toward smaller ones. Concurrent renders may
+ * lose each other's update, which only makes it lag a render behind.
+ */
+void
+template_learn(struct kore_mustach_template *tpl, size_t len)
+{
+    size_t  est = __atomic_load_n(&tpl->estimate, __ATOMIC_RELAXED);
+
+    if (len >= est)
+        est = len;
+    else
+        est -= (est - len) / 8;
+
+    __atomic_store_n(&tpl->estimate, est, __ATOMIC_RELAXED);
+}
+
+/* Templates shared through the partial cache are freed by their last user. */
+struct kore_mustach_template *
+template_ref(struct kore_mustach_template *tpl)
+{
+    __sync_fetch_and_add(&tpl->refs, 1);
+    return (tpl);
+}
+
+void
+template_release(struct kore_mustach_template *tpl)
+{
+    if (__sync_sub_and_fetch(&tpl->refs, 1) == 0)
+        kore_mustach_template_free(tpl);
+}
+
+/*
+ * Folds what 'ops' [begin, end) of 'tpl' make of the static data into the
+ * residual template. Sections and tags that are left for the request are
+ * copied over with their bodies specialized in turn. The static frames
+ * at 'barrier' and below are under a section on request data, which may
+ * shadow their members.
+ */
+int
+spec_exec(struct spec *sp, struct kore_mustach_template *tpl, size_t begin,
+        size_t end, struct prefix *prefix, int barrier)
+{
+    struct op   *op;
+    size_t      pc, offset;
+    int         rc;
+
+    for (pc = begin, rc = MUSTACH_OK; pc < end && rc == MUSTACH_OK; pc++) {
+        op = &tpl->ops[pc];
+
+        switch (op->type) {
+            case OP_TEXT:
+                spec_text(sp, op->text, op->length, 0);
+                break;
+
+            case OP_INDENT:
+                offset = sp->text.offset;
+                spec_prefix(sp, prefix);
+                spec_literal(sp, offset);
+                break;
+
+            case OP_PUT:
+                rc = spec_put(sp, op, barrier);
+                break;
+
+            case OP_SECTION:
+                rc = spec_section(sp, tpl, pc, prefix, barrier);
+                pc = op->jump;
+                break;
+
+            case OP_PARTIAL:
+                rc = spec_partial(sp, op, prefix, barrier);
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    return (rc);
+}
+
+int
+spec_put(struct spec *sp, struct op *op, int barrier)
+{
+    struct closure      *cl = sp->cl;
+    struct key          *key = op->key;
+    struct mustach_sbuf sbuf = {};
+    void                *item;
+
+    /* the root context is the request data as much as the static one */
+    if (key->self || key->iterate) {
+        if (cl->depth <= barrier || cl->depth == 0) {
+            spec_op(sp, op);
+            return (MUSTACH_OK);
+        }
+        if (key->iterate)
+            sbuf.value = data_name(cl, cl->context);
+        else
+            data_tosbuf(cl, cl->context, &sbuf);
+        spec_text(sp, sbuf.value, sbuf_length(&sbuf), op->flag);
+        return (MUSTACH_OK);
+    }
+
+    /* lambdas run when the request is rendered */
+    item = spec_lookup(sp, key->segs, key->count, barrier);
+    if (item == NULL || data_kind(cl, item) == KORE_MUSTACH_LAMBDA) {
+        spec_op(sp, op);
+        return (MUSTACH_OK);
+    }
+
+    if (key->comp == C_no || evalcomp(cl, item, &key->operand, key->comp)) {
+        data_tosbuf(cl, item, &sbuf);
+        spec_text(sp, sbuf.value, sbuf_length(&sbuf), op->flag);
+    }
+
+    return (MUSTACH_OK);
+}
+
+/*
+ * A section on static data is entered as a render would and its body
+ * specialized for each element, one left for the request is copied.
+ */
+int
+spec_section(struct spec *sp, struct kore_mustach_template *tpl, size_t pc,
+        struct prefix *prefix, int barrier)
+{
+    struct closure  *cl = sp->cl;
+    struct op       *op = &tpl->ops[pc];
+    void            *item;
+    size_t          open, close;
+    int             rc;
+
+    /* a cache section is left for the request, its key with it */
+    if (op->key->cache && !op->flag)
+        item = NULL;
+    else if (op->key->iterate)
+        item = (cl->depth > barrier && cl->depth > 0) ? cl->context : NULL;
+    else
+        item = spec_lookup(sp, op->key->segs, op->key->count, barrier);
+
+    if (item == NULL || data_kind(cl, item) == KORE_MUSTACH_LAMBDA) {
+        open = spec_op(sp, op);
+        rc = spec_exec(sp, tpl, pc + 1, op->jump, prefix, cl->depth);
+        close = spec_op(sp, &tpl->ops[op->jump]);
+        sp->res->ops[open].jump = close;
+        sp->res->ops[close].jump = open;
+        return (rc);
+    }
+
+    if ((rc = enter(cl, op->key)) < 0)
+        return (rc);
+
+    if (op->flag) {
+        if (rc > 0)
+            return (leave(cl));
+        return (spec_exec(sp, tpl, pc + 1, op->jump, prefix, barrier));
+    }
+
+    if (rc == 0)
+        return (MUSTACH_OK);
+
+    do {
+        if ((rc = spec_exec(sp, tpl, pc + 1, op->jump, prefix, barrier)) < 0)
+            return (rc);
+    } while ((rc = next(cl)) > 0);
+
+    return (rc < 0 ? rc : leave(cl));
+}
+
+/*
+ * Partials are inlined, looked up the way partial() does it. One found
+ * nowhere is left for the request data to provide, indented as deep as
+ * it is here.
+ */
+int
+spec_partial(struct spec *sp, struct op *op, struct prefix *prefix, int barrier)
+{
+    struct kore_mustach_template    *sub;
+    struct mustach_sbuf             sbuf = {};
+    struct seg                      segs[MUSTACH_MAX_DEPTH];
+    struct prefix                   pref;
+    struct op                       *n;
+    void                            *item;
+    size_t                          offset, i;
+    int                             count, rc = MUSTACH_OK;
+
+    if (prefix != NULL && prefix->depth == MUSTACH_MAX_DEPTH)
+        return (MUSTACH_ERROR_TOO_DEEP);
+
+    if ((sub = partial_file(op->name, sp->res->flags, 0, &rc)) == NULL && rc == MUSTACH_OK) {
+        if ((count = path_split(op->name, segs)) != -1 &&
+                (item = spec_lookup(sp, segs, count, barrier)) != NULL) {
+            data_tosbuf(sp->cl, item, &sbuf);
+            sub = template_compile(sbuf.value, sbuf_length(&sbuf), sp->res->flags, &rc);
+        } else {
+            sub = partial_file(op->name, sp->res->flags, 1, &rc);
+        }
+    }
+
+    if (rc != MUSTACH_OK)
+        return (rc);
+
+    if (sub == NULL) {
+        offset = sp->text.offset;
+        spec_prefix(sp, prefix);
+        kore_buf_append(&sp->text, op->text, op->length);
+
+        i = spec_op(sp, op);
+        n = &sp->res->ops[i];
+        n->text = (const char *)offset;
+        n->length = sp->text.offset - offset;
+        return (MUSTACH_OK);
+    }
+
+    pref = (struct prefix){ op->text, op->length,
+        prefix != NULL ? prefix->depth + 1 : 1, prefix };
+    rc = spec_exec(sp, sub, 0, sub->count, &pref, barrier);
+    template_release(sub);
+
+    return (rc);
+}
+
+/*
+ * Resolves 'segs' on the static frames as data_in_stack() would. Below
+ * the barrier only the members of the static root are taken: the request
+ * data has none of them, it may have any other name.
+ */
+void *
+spec_lookup(struct spec *sp, const struct seg *segs, size_t count, int barrier)
+{
+    struct closure  *cl = sp->cl;
+    void            *o;
+    int             level;
+
+    if (count == 0 || sp->root == NULL)
+        return (NULL);
+
+    for (level = cl->depth; level > barrier; level--) {
+        o = (level == cl->depth) ? cl->context : cl->stack[level + 1].root;
+        if ((o = data_get(cl, o, segs, count)) != NULL)
+            return (o);
+    }
+
+    if (level < 0 || data_member(cl, sp->root, segs[0].name, segs[0].len) == NULL)
+        return (NULL);
+
+    for (; level >= 0; level--) {
+        o = (level == cl->depth) ? cl->context : cl->stack[level + 1].root;
+        if ((o = data_get(cl, o, segs, count)) != NULL)
+            return (o);
+    }
+
+    return (NULL);
+}
+
+/* Copies 'op' into the residual template, returning its index there. */
+size_t
+spec_op(struct spec *sp, struct op *op)
+{
+    struct op   *n;
+
+    n = template_op(sp->res, op->type, op->name, op->name != NULL ? strlen(op->name) : 0);
+    n->flag = op->flag;
+
+    return (n - sp->res->ops);
+}
+
+void
+spec_text(struct spec *sp, const char *text, size_t length, int escape)
+{
+    size_t  offset = sp->text.offset;
+
+    if (escape)
+        escape_append(&sp->text, text, length);
+    else
+        kore_buf_append(&sp->text, text, length);
+
+    spec_literal(sp, offset);
+}
+
+/*
+ * Makes the text appended from 'offset' on part of the output, extending
+ * the last op of the residual template when that is the text right before.
+ */
+void
+spec_literal(struct spec *sp, size_t offset)
+{
+    struct kore_mustach_template    *res = sp->res;
+    struct op                       *op = NULL;
+
+    if (sp->text.offset == offset)
+        return;
+
+    if (res->count > 0)
+        op = &res->ops[res->count - 1];
+
+    if (op == NULL || op->type != OP_TEXT || (size_t)op->text + op->length != offset) {
+        op = template_op(res, OP_TEXT, NULL, 0);
+        op->text = (const char *)offset;
+    }
+
+    op->length += sp->text.offset - offset;
+}
+
+/* Appends the indentation of the partials 'prefix' is in, outermost first. */
+void
+spec_prefix(struct spec *sp, struct prefix *prefix)
+{
+    if (prefix == NULL)
+        return;
+
+    spec_prefix(sp, prefix->parent);
+    kore_buf_append(&sp->text, prefix->text, prefix->length);
+}
+
+/* Lambda sections nest, their buffers are handed out and back in stack order. */
+struct kore_buf *
+buf_get(struct closure *cl)
+{
+    if (cl->nspare > 0)
+        return (cl->spare[--cl->nspare]);
+
+    cl->stats.allocs++;
+    return (kore_buf_alloc(128));
+}
+
+void
+buf_put(struct closure *cl, struct kore_buf *buf)
+{
+    if (cl->nspare == cl->spare_size) {
+        cl->spare_size = cl->spare_size ? cl->spare_size * 2 : 8;
+        cl->spare = kore_realloc(cl->spare, cl->spare_size * sizeof(*cl->spare));
+    }
+
+    kore_buf_reset(buf);
+    cl->spare[cl->nspare++] = buf;
+}
+
+/* Makes room for 'len' more bytes in 'buf', doubling it so growth is not copied over and over. */
+void
+buf_reserve(struct kore_buf *buf, size_t len)
+{
+    size_t  size;
+
+    if (buf->length - buf->offset >= len)
+        return;
+
+    size = buf->length * 2;
+    if (size < buf->offset + len)
+        size = buf->offset + len;
+
+    buf->data = kore_realloc(buf->data, size);
+    buf->length = size;
+}
+
+/* Readies 'cl' for a render, keeping what earlier renders left to reuse. */
+void
+closure_init(struct closure *cl, void *data, int flags)
+{
+    cl->context = data;
+    cl->provider = NULL;
+    cl->arg = NULL;
+    cl->result = NULL;
+    cl->out = NULL;
+    cl->windows = 0;
+    cl->segments = NULL;
+    cl->flags = flags;
+    cl->depth = 0;
+    cl->req = NULL;
+    cl->status = 0;
+    cl->streaming = 0;
+    cl->chunk = 0;
+}
+
+struct kore_mustach_ctx *
+ctx_get(void)
+{
+    struct kore_mustach_ctx *ctx = spare_ctx;
+
+    spare_ctx = NULL;
+    return (ctx != NULL ? ctx : kore_mustach_ctx_alloc());
+}
+
+void
+ctx_put(struct kore_mustach_ctx *ctx)
+{
+    if (spare_ctx == NULL)
+        spare_ctx = ctx;
+    else
+        kore_mustach_ctx_free(ctx);
+}
+
+/* Renders 'tpl' on the data 'ctx' was readied with, handing out the result. */
+int
+ctx_render(struct kore_mustach_ctx *ctx, struct kore_mustach_template *tpl,
+        struct kore_buf **result)
+{
+    ctx->error = template_render(tpl, &ctx->cl);
+
+    if (ctx->error >= 0) {
+        if (ctx->cl.provider == NULL)
+            ctx->error = kore_json_errno();
+        *result = ctx->cl.result;
+    } else {
+        kore_buf_free(ctx->cl.result);
+        *result = NULL;
+    }
+
+    ctx->cl.result = NULL;
+    return (ctx->error >= 0 ? KORE_RESULT_OK : KORE_RESULT_ERROR);
+}
+
+int
+prefix_emit(struct closure *cl, struct prefix *prefix)
+{
+    int rc;
+
+    if (prefix == NULL)
+        return (MUSTACH_OK);
+
+    if ((rc = prefix_emit(cl, prefix->parent)) < 0)
+        return (rc);
+
+    if (prefix->length == 0)
+        return (MUSTACH_OK);
+
+    return (emit(cl, prefix->text, prefix->length, 0, NULL));
+}
+
+/*
+ * Same as emit() for text that lives as long as the template and data of
+ * the render, which segmented output points to instead of copying when
+ * it is long enough and needs no escaping.
+ */
+int
+emit_held(struct closure *cl, const char *buffer, size_t size, int escape)
+{
+    if (cl->segments == NULL || cl->out != cl->result || cl->windows != 0 ||
+            size < SEGMENT_MIN ||
+            (escape && escape_scan(buffer, buffer + size) != buffer + size))
+        return (emit(cl, buffer, size, escape, NULL));
+
+    segments_span(cl->segments, cl->result->offset, buffer, size);
+    if (escape)
+        cl->stats.escaped += size;
+    cl->stats.emitted += size;
+
+    return (MUSTACH_OK);
+}
+
+/* Adds a span for 'len' bytes at 'base', after the data copied up to 'end'. */
+void
+segments_span(struct kore_mustach_segments *segs, size_t end, const char *base, size_t len)
+{
+    struct span *last;
+
+    segments_close(segs, end);
+
+    last = segs->count > 0 ? &segs->spans[segs->count - 1] : NULL;
+    if (last != NULL && last->base != NULL && last->base + last->length == base) {
+        last->length += len;
+        return;
+    }
+
+    segments_add(segs, base, 0, len);
+}
+
+/* Ends the run of data copied since the last span, up to 'end', in a span. */
+void
+segments_close(struct kore_mustach_segments *segs, size_t end)
+{
+    if (end == segs->mark)
+        return;
+
+    segments_add(segs, NULL, segs->mark, end - segs->mark);
+    segs->mark = end;
+}
+
+void
+segments_add(struct kore_mustach_segments *segs, const char *base, size_t offset, size_t len)
+{
+    if (segs->count == segs->size) {
+        segs->size = segs->size ? segs->size * 2 : 16;
+        segs->spans = kore_realloc(segs->spans, segs->size * sizeof(*segs->spans));
+    }
+    segs->spans[segs->count++] = (struct span){ base, offset, len };
+}
+
+/* Keeps the reference to 'tpl' the render took, or drops a second one. */
+void
+segments_hold(struct kore_mustach_segments *segs, struct kore_mustach_template *tpl)
+{
+    size_t  i;
+
+    for (i = 0; i < segs->nheld; i++) {
+        if (segs->held[i] == tpl) {
+            template_release(tpl);
+            return;
+        }
+    }
+
+    if (segs->nheld == segs->held_size) {
+        segs->held_size = segs->held_size ? segs->held_size * 2 : 8;
+        segs->held = kore_realloc(segs->held, segs->held_size * sizeof(*segs->held));
+    }
+    segs->held[segs->nheld++] = tpl;
+}
+
+/* Turns the spans into iovecs, now that the data is complete. */
+void
+segments_finish(struct kore_mustach_segments *segs)
+{
+    struct span *sp;
+    const char  *base;
+    size_t      i;
+
+    segments_close(segs, segs->data->offset);
+
+    segs->iov = kore_calloc(segs->count + 1, sizeof(*segs->iov));
+    for (i = 0; i < segs->count; i++) {
+        sp = &segs->spans[i];
+        base = sp->base != NULL ? sp->base : (const char *)segs->data->data + sp->offset;
+        /* iovecs are not const, the spans are only ever read */
+        segs->iov[i].iov_base = (void *)(uintptr_t)base;
+        segs->iov[i].iov_len = sp->length;
+        segs->length += sp->length;
+    }
 }
 
-void
-mustach_runtime_execute(void *addr, struct kore_buf *buf)
+/*
+ * Renders 'tpl' for 'json' as segments, which only point into the json
+ * strings with 'borrow' set, and always into the template and partials.
+ */
+int
+segments_render(struct kore_mustach_template *tpl, struct kore_json_item *json, int borrow,
+        struct kore_mustach_segments **segs)
 {
-    void (*cb)(struct kore_buf *);
+    struct kore_mustach_ctx *ctx = ctx_get();
+    int                     rc;
+
+    *segs = kore_calloc(1, sizeof(**segs));
+    (*segs)->borrow = borrow;
 
-    *(void **)&(cb) = addr;
-    cb(buf);
+    closure_init(&ctx->cl, json, tpl->flags);
+    ctx->cl.segments = *segs;
+
+    if ((rc = ctx_render(ctx, tpl, &(*segs)->data)) == KORE_RESULT_OK) {
+        segments_finish(*segs);
+    } else {
+        kore_mustach_segments_free(*segs);
+        *segs = NULL;
+    }
+
+    ctx->cl.segments = NULL;
+    mustach_errno = ctx->error;
+    ctx_put(ctx);
+
+    return (rc);
 }
 
+/* Frees the segments of a response once kore sent or dropped its last netbuf. */
 int
-kore_mustach_errno(void)
+segments_sent(struct netbuf *nb)
 {
-    return (mustach_errno);
+    kore_mustach_segments_free(nb->extra);
+
+    return (KORE_RESULT_OK);
+}
+
+size_t
+sbuf_length(struct mustach_sbuf *sbuf)
+{
+    if (sbuf->length == 0 && sbuf->value != NULL)
+        return (strlen(sbuf->value));
+
+    return (sbuf->length);
+}
+
+void
+sbuf_release(struct mustach_sbuf *sbuf)
+{
+    if (sbuf->releasecb != NULL)
+        sbuf->releasecb(sbuf->value, sbuf->closure);
 }
 
 const char *
-kore_mustach_strerror(void)
+error_string(int error)
 {
-    size_t err = mustach_errno * -1;
+    size_t err = error * -1;
 
-    if (mustach_errno == kore_json_errno())
+    if (error == kore_json_errno())
         return (kore_json_strerror());
 
     if (err < sizeof(mustach_errtab) / sizeof(mustach_errtab[0]))
@@ -588,36 +4236,572 @@ kore_mustach_strerror(void)
     return ("unknown mustach error");
 }
 
+int
+kore_mustach_errno(void)
+{
+    return (mustach_errno);
+}
+
+const char *
+kore_mustach_strerror(void)
+{
+    return (error_string(mustach_errno));
+}
+
 struct kore_json_item *
 kore_mustach_find(const char *name)
 {
-    if (global_cl == NULL)
+    if (current == NULL)
+        return (NULL);
+
+    return (json_find(current, name));
+}
+
+void *
+kore_mustach_lookup(const char *name)
+{
+    if (current == NULL)
         return (NULL);
 
-    return (json_item_in_stack(global_cl, name));
+    return (data_find(current, name));
+}
+
+void
+kore_mustach_register_lambda(const char *name, void (*cb)(struct kore_buf *))
+{
+    struct lambda   *l;
+
+    pthread_rwlock_wrlock(&lambda_lock);
+    l = lambda_entry(name, 1);
+    l->cb = cb;
+    l->cb_ctx = NULL;
+    l->cb_inplace = NULL;
+    l->resolved = 1;
+    pthread_rwlock_unlock(&lambda_lock);
+}
+
+void
+kore_mustach_register_lambda_ctx(const char *name,
+        void (*cb)(struct kore_mustach_ctx *, struct kore_buf *))
+{
+    struct lambda   *l;
+
+    pthread_rwlock_wrlock(&lambda_lock);
+    l = lambda_entry(name, 1);
+    l->cb = NULL;
+    l->cb_ctx = cb;
+    l->cb_inplace = NULL;
+    l->resolved = 1;
+    pthread_rwlock_unlock(&lambda_lock);
+}
+
+void
+kore_mustach_register_lambda_inplace(const char *name,
+        void (*cb)(struct kore_mustach_ctx *, struct kore_buf *, size_t))
+{
+    struct lambda   *l;
+
+    pthread_rwlock_wrlock(&lambda_lock);
+    l = lambda_entry(name, 1);
+    l->cb = NULL;
+    l->cb_ctx = NULL;
+    l->cb_inplace = cb;
+    l->resolved = 1;
+    pthread_rwlock_unlock(&lambda_lock);
+}
+
+void
+kore_mustach_template_size_hint(struct kore_mustach_template *tpl, size_t size)
+{
+    tpl->hint = size;
+}
+
+void
+kore_mustach_stats_ctx(struct kore_mustach_ctx *ctx, struct kore_mustach_stats *stats)
+{
+    *stats = ctx->cl.stats;
+}
+
+void
+kore_mustach_stats_log(u_int64_t usec)
+{
+    stats_threshold = usec;
+}
+
+void
+kore_mustach_partial_check(u_int64_t msec)
+{
+    __atomic_store_n(&partial_check, msec, __ATOMIC_RELAXED);
+}
+
+void
+kore_mustach_cache_size(size_t size)
+{
+    pthread_mutex_lock(&fragment_lock);
+    __atomic_store_n(&fragment_max, size, __ATOMIC_RELAXED);
+    fragment_trim(size);
+    pthread_mutex_unlock(&fragment_lock);
+}
+
+void
+kore_mustach_cache_ttl(u_int64_t msec)
+{
+    pthread_mutex_lock(&fragment_lock);
+    fragment_ttl = msec;
+    pthread_mutex_unlock(&fragment_lock);
+}
+
+void
+kore_mustach_cache_invalidate(const char *name, const char *value)
+{
+    struct fragment *f, *n;
+
+    pthread_mutex_lock(&fragment_lock);
+    for (f = TAILQ_FIRST(&fragment_lru); f != NULL; f = n) {
+        n = TAILQ_NEXT(f, lru);
+        if ((name == NULL || !strcmp(f->name, name)) &&
+                (value == NULL || !strcmp(f->value, value)))
+            fragment_remove(f);
+    }
+    pthread_mutex_unlock(&fragment_lock);
+}
+
+void
+kore_mustach_parallel(size_t min, int threads)
+{
+    pthread_mutex_lock(&parallel_lock);
+    __atomic_store_n(&parallel_min, min, __ATOMIC_RELAXED);
+    __atomic_store_n(&parallel_max, threads > 0 ? threads : 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&parallel_lock);
+}
+
+struct kore_mustach_ctx *
+kore_mustach_ctx_alloc(void)
+{
+    struct kore_mustach_ctx *ctx;
+
+    ctx = kore_calloc(1, sizeof(*ctx));
+    ctx->cl.index.arena = &ctx->cl.arena;
+
+    return (ctx);
+}
+
+void
+kore_mustach_ctx_free(struct kore_mustach_ctx *ctx)
+{
+    struct closure  *cl;
+
+    if (ctx == NULL)
+        return;
+
+    cl = &ctx->cl;
+    while (cl->nspare > 0)
+        kore_buf_free(cl->spare[--cl->nspare]);
+
+    kore_free(cl->spare);
+    kore_buf_cleanup(&cl->scratch);
+    arena_free(&cl->arena);
+    kore_free(ctx);
 }
 
 int
-kore_mustach_json(const char *template, struct kore_json_item *json, int flags,
+kore_mustach_errno_ctx(struct kore_mustach_ctx *ctx)
+{
+    return (ctx->error);
+}
+
+const char *
+kore_mustach_strerror_ctx(struct kore_mustach_ctx *ctx)
+{
+    return (error_string(ctx->error));
+}
+
+struct kore_json_item *
+kore_mustach_find_ctx(struct kore_mustach_ctx *ctx, const char *name)
+{
+    return (json_find(&ctx->cl, name));
+}
+
+void *
+kore_mustach_lookup_ctx(struct kore_mustach_ctx *ctx, const char *name)
+{
+    return (data_find(&ctx->cl, name));
+}
+
+struct kore_mustach_template *
+kore_mustach_compile(const char *template, int flags)
+{
+    return (template_compile(template, strlen(template), flags, &mustach_errno));
+}
+
+int
+kore_mustach_render(struct kore_mustach_template *tpl, struct kore_json_item *json,
+        struct kore_buf **result)
+{
+    struct kore_mustach_ctx *ctx = ctx_get();
+    int                     rc;
+
+    rc = kore_mustach_render_ctx(ctx, tpl, json, result);
+    mustach_errno = ctx->error;
+    ctx_put(ctx);
+
+    return (rc);
+}
+
+int
+kore_mustach_render_ctx(struct kore_mustach_ctx *ctx, struct kore_mustach_template *tpl,
+        struct kore_json_item *json, struct kore_buf **result)
+{
+    closure_init(&ctx->cl, json, tpl->flags);
+    return (ctx_render(ctx, tpl, result));
+}
+
+int
+kore_mustach_render_data(struct kore_mustach_template *tpl,
+        const struct kore_mustach_provider *provider, void *arg, void *root,
+        struct kore_buf **result)
+{
+    struct kore_mustach_ctx *ctx = ctx_get();
+    int                     rc;
+
+    rc = kore_mustach_render_data_ctx(ctx, tpl, provider, arg, root, result);
+    mustach_errno = ctx->error;
+    ctx_put(ctx);
+
+    return (rc);
+}
+
+int
+kore_mustach_render_data_ctx(struct kore_mustach_ctx *ctx, struct kore_mustach_template *tpl,
+        const struct kore_mustach_provider *provider, void *arg, void *root,
         struct kore_buf **result)
 {
-    struct closure  cl = { .context = json, .flags = flags };
+    closure_init(&ctx->cl, root, tpl->flags);
+    ctx->cl.provider = provider;
+    ctx->cl.arg = arg;
+
+    return (ctx_render(ctx, tpl, result));
+}
+
+int
+kore_mustach_render_batch(struct kore_mustach_template *tpl, struct kore_json_item **items,
+        size_t count, int concat, struct kore_buf **results)
+{
+    struct kore_mustach_ctx *ctx;
+    struct kore_buf         *buf = NULL;
+    size_t                  i, n;
+    int                     rc = KORE_RESULT_OK;
+
+    /* 'results' may have no room at all */
+    if (count == 0) {
+        mustach_errno = MUSTACH_OK;
+        return (KORE_RESULT_OK);
+    }
+
+    ctx = ctx_get();
+
+    for (i = 0; i < count && rc == KORE_RESULT_OK; i++) {
+        closure_init(&ctx->cl, items[i], tpl->flags);
+
+        /* concatenated, each render appends to the output of the last */
+        if (concat) {
+            ctx->cl.result = buf;
+            rc = ctx_render(ctx, tpl, &buf);
+        } else {
+            rc = ctx_render(ctx, tpl, &results[i]);
+        }
+    }
+
+    if (concat) {
+        if (rc == KORE_RESULT_OK && buf == NULL)
+            buf = kore_buf_alloc(RESULT_SIZE);
+        results[0] = buf;
+    } else if (rc != KORE_RESULT_OK) {
+        /* up to the one that failed, which is already NULL */
+        for (n = 0; n < count; n++) {
+            if (n < i && results[n] != NULL)
+                kore_buf_free(results[n]);
+            results[n] = NULL;
+        }
+    }
+
+    mustach_errno = ctx->error;
+    ctx_put(ctx);
+
+    return (rc);
+}
+
+int
+kore_mustach_render_list(struct kore_mustach_template *tpl, struct kore_json_item *array,
+        int concat, struct kore_buf **results)
+{
+    struct kore_json_item   **items, *item;
+    size_t                  count = 0;
+    int                     rc;
+
+    TAILQ_FOREACH(item, &array->data.items, list)
+        count++;
+
+    items = kore_calloc(count + 1, sizeof(*items));
+    count = 0;
+    TAILQ_FOREACH(item, &array->data.items, list)
+        items[count++] = item;
+
+    rc = kore_mustach_render_batch(tpl, items, count, concat, results);
+    kore_free(items);
+
+    return (rc);
+}
+
+int
+kore_mustach_http(struct http_request *req, int status,
+        struct kore_mustach_template *tpl, struct kore_json_item *json, size_t chunk)
+{
+    struct kore_mustach_ctx *ctx = ctx_get();
+    struct closure          *cl = &ctx->cl;
+
+    closure_init(cl, json, tpl->flags);
+    cl->status = status;
+    cl->chunk = chunk ? chunk : STREAM_CHUNK;
 
-    global_cl = &cl;
-    mustach_errno = mustach_file(template, 0, &itf, &cl, flags, 0);
+    /* a HEAD response has no body to stream, HTTP/1.0 has no chunks */
+    if (req->method != HTTP_METHOD_HEAD && !(req->flags & HTTP_VERSION_1_0))
+        cl->req = req;
+
+    mustach_errno = template_render(tpl, cl);
 
     if (mustach_errno >= 0) {
         mustach_errno = kore_json_errno();
-        *result = cl.result;
-    } else {
-        kore_buf_free(cl.result);
-        *result = NULL;
+        if (!cl->streaming)
+            http_response(req, status, cl->result->data, cl->result->offset);
+        else if (stream_flush(cl, 1) != MUSTACH_OK)
+            mustach_errno = MUSTACH_ERROR_SYSTEM;
+    } else if (cl->streaming) {
+        kore_connection_disconnect(req->owner);
     }
 
-    global_cl = NULL;
+    kore_buf_free(cl->result);
+    cl->result = NULL;
+    ctx_put(ctx);
+
     return (mustach_errno >= 0 ? KORE_RESULT_OK : KORE_RESULT_ERROR);
 }
 
+int
+kore_mustach_render_segments(struct kore_mustach_template *tpl, struct kore_json_item *json,
+        struct kore_mustach_segments **segs)
+{
+    return (segments_render(tpl, json, 1, segs));
+}
+
+const struct iovec *
+kore_mustach_segments_iov(struct kore_mustach_segments *segs, int *count, size_t *length)
+{
+    *count = (int)segs->count;
+    if (length != NULL)
+        *length = segs->length;
+
+    return (segs->iov);
+}
+
+void
+kore_mustach_segments_free(struct kore_mustach_segments *segs)
+{
+    size_t  i;
+
+    if (segs == NULL)
+        return;
+
+    for (i = 0; i < segs->nheld; i++)
+        template_release(segs->held[i]);
+
+    if (segs->data != NULL)
+        kore_buf_free(segs->data);
+
+    kore_free(segs->held);
+    kore_free(segs->spans);
+    kore_free(segs->iov);
+    kore_free(segs);
+}
+
+int
+kore_mustach_http_segments(struct http_request *req, int status,
+        struct kore_mustach_template *tpl, struct kore_json_item *json)
+{
+    struct kore_mustach_segments    *segs;
+    struct netbuf                   *nb;
+    size_t                          i;
+
+    /* the json data is usually gone by the time the segments are sent */
+    if (!segments_render(tpl, json, 0, &segs))
+        return (KORE_RESULT_ERROR);
+
+    /* the headers carry the length, the body is queued after them */
+    http_response(req, status, NULL, segs->length);
+
+    if (req->method == HTTP_METHOD_HEAD || segs->count == 0) {
+        kore_mustach_segments_free(segs);
+        return (KORE_RESULT_OK);
+    }
+
+    /* sent from where they are, the last netbuf frees them all */
+    for (i = 0; i < segs->count - 1; i++) {
+        net_send_stream(req->owner, segs->iov[i].iov_base, segs->iov[i].iov_len,
+            NULL, NULL);
+    }
+    net_send_stream(req->owner, segs->iov[i].iov_base, segs->iov[i].iov_len,
+        segments_sent, &nb);
+    nb->extra = segs;
+
+    if (net_send_flush(req->owner) != KORE_RESULT_OK) {
+        mustach_errno = MUSTACH_ERROR_SYSTEM;
+        return (KORE_RESULT_ERROR);
+    }
+
+    return (KORE_RESULT_OK);
+}
+
+void
+kore_mustach_template_free(struct kore_mustach_template *tpl)
+{
+    size_t  i;
+
+    if (tpl == NULL)
+        return;
+
+    for (i = 0; i < tpl->count; i++) {
+        kore_free(tpl->ops[i].name);
+        kore_free(tpl->ops[i].key);
+    }
+
+    kore_free(tpl->ops);
+    kore_free(tpl->text);
+    kore_free(tpl);
+}
+
+struct kore_mustach_template *
+kore_mustach_specialize(struct kore_mustach_template *tpl, struct kore_json_item *json)
+{
+    struct kore_mustach_ctx         *ctx = ctx_get();
+    struct spec                     sp = {};
+    struct kore_mustach_template    *res;
+    struct op                       *op;
+    size_t                          i;
+
+    res = kore_calloc(1, sizeof(*res));
+    res->flags = tpl->flags;
+    res->refs = 1;
+    res->hint = tpl->hint;
+
+    sp.cl = &ctx->cl;
+    sp.root = json;
+    sp.res = res;
+    kore_buf_init(&sp.text, tpl->length);
+
+    closure_init(sp.cl, json, tpl->flags);
+    if ((mustach_errno = start(sp.cl)) == MUSTACH_OK)
+        mustach_errno = spec_exec(&sp, tpl, 0, tpl->count, NULL, -1);
+
+    kore_buf_free(sp.cl->result);
+    sp.cl->result = NULL;
+    index_cleanup(&sp.cl->index);
+    arena_reset(&sp.cl->arena);
+    sp.cl->context = NULL;
+    ctx_put(ctx);
+
+    res->length = sp.text.offset;
+    res->text = kore_malloc(res->length + 1);
+    memcpy(res->text, sp.text.data, res->length);
+    res->text[res->length] = '\0';
+    kore_buf_cleanup(&sp.text);
+
+    if (mustach_errno != MUSTACH_OK) {
+        kore_mustach_template_free(res);
+        return (NULL);
+    }
+
+    /* the text was still growing, its ops only knew their offsets */
+    for (i = 0; i < res->count; i++) {
+        op = &res->ops[i];
+        if (op->type == OP_TEXT || op->type == OP_PARTIAL)
+            op->text = res->text + (size_t)op->text;
+    }
+    template_sign(res);
+
+    return (res);
+}
+
+int
+kore_mustach_json(const char *template, struct kore_json_item *json, int flags,
+        struct kore_buf **result)
+{
+    struct kore_mustach_template    *tpl;
+    int                             rc;
+
+    if ((tpl = kore_mustach_compile(template, flags)) == NULL) {
+        *result = NULL;
+        return (KORE_RESULT_ERROR);
+    }
+
+    rc = kore_mustach_render(tpl, json, result);
+    kore_mustach_template_free(tpl);
+
+    return (rc);
+}
+
+int
+kore_mustach_json_cached(const char *template, struct kore_json_item *json, int flags,
+        struct kore_buf **result, char *etag)
+{
+    struct kore_buf key;
+    u_int64_t       sig, hash;
+    int             rc;
+
+    kore_buf_init(&key, RESULT_SIZE);
+    sig = output_key(template, flags, json, &key);
+
+    if ((rc = output_render(template, json, flags, &key, sig, result, &hash)) && etag != NULL)
+        etag_format(etag, hash);
+    kore_buf_cleanup(&key);
+
+    return (rc);
+}
+
+int
+kore_mustach_http_cached(struct http_request *req, int status, const char *template,
+        struct kore_json_item *json, int flags)
+{
+    struct kore_buf *result, key;
+    const char      *match;
+    char            etag[KORE_MUSTACH_ETAG_LEN];
+    u_int64_t       sig, hash;
+    int             rc;
+
+    kore_buf_init(&key, RESULT_SIZE);
+    sig = output_key(template, flags, json, &key);
+
+    /* the etag is the output's, a cached page has it without a render */
+    if ((rc = output_render(template, json, flags, &key, sig, &result, &hash))) {
+        etag_format(etag, hash);
+        http_response_header(req, "etag", etag);
+
+        /* only what would be a successful GET or HEAD is conditional */
+        if (status >= 200 && status < 300 &&
+                (req->method == HTTP_METHOD_GET || req->method == HTTP_METHOD_HEAD) &&
+                http_request_header(req, "if-none-match", &match) &&
+                etag_match(match, etag))
+            http_response(req, 304, NULL, 0);
+        else
+            http_response(req, status, result->data, result->offset);
+
+        kore_buf_free(result);
+    }
+
+    kore_buf_cleanup(&key);
+
+    return (rc);
+}
+
 int
 kore_mustach(const char *template, const char *data, int flags,
         struct kore_buf **result)
@@ -625,6 +4809,9 @@ kore_mustach(const char *template, const char *data, int flags,
     struct kore_json json = {};
     mustach_errno = 0;
 
+    if (data != NULL && (flags & Mustach_With_LazyJson))
+        return (lazy_render(template, data, flags, result));
+
     if (data != NULL) {
         kore_json_init(&json, data, strlen(data));
         if (!kore_json_parse(&json))
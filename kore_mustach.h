@@ -17,9 +17,37 @@
 #ifndef KORE_MUSTACH_H
 #define KORE_MUSTACH_H
 
+struct http_request;
+struct iovec;
+struct kore_mustach_ctx;
+struct kore_mustach_segments;
+struct kore_mustach_template;
+
+/*
+ * What a render did, filled in by every render. @see kore_mustach_stats_ctx()
+ */
+struct kore_mustach_stats {
+    u_int64_t   tags;           /* variable tags rendered */
+    u_int64_t   sections;       /* section bodies rendered, the first time */
+    u_int64_t   iterations;     /* section bodies rendered again for a list */
+    u_int64_t   lookups;        /* names looked up in the data context */
+    u_int64_t   misses;         /* lookups that found nothing */
+    u_int64_t   frames;         /* context stack frames searched by lookups */
+    u_int64_t   partials;       /* partials rendered */
+    u_int64_t   lambdas;        /* lambdas called */
+    u_int64_t   fragments;      /* cache sections served from the fragment cache */
+    u_int64_t   emitted;        /* bytes of text and values emitted */
+    u_int64_t   escaped;        /* bytes of those that went through html escaping */
+    u_int64_t   allocs;         /* buffers and blocks allocated, growth aside */
+    u_int64_t   elapsed;        /* wall time in nanoseconds */
+};
+
 /**
- * Flags specific to mustach
+ * Flags of mustach, the values it gives them
  */
+#define Mustach_With_NoExtensions 0
+#define Mustach_With_Colon        1
+#define Mustach_With_EmptyTag     2
 #define Mustach_With_SingleDot    4     /* obsolete, always set */
 #define Mustach_With_Equal        8
 #define Mustach_With_Compare      16
@@ -28,9 +56,48 @@
 #define Mustach_With_IncPartial   128   /* obsolete, always set */
 #define Mustach_With_EscFirstCmp  256
 
-#undef  Mustach_With_AllExtensions
 #define Mustach_With_AllExtensions  511
 
+/**
+ * Error codes of mustach, @see kore_mustach_errno()
+ */
+#define MUSTACH_OK                       0
+#define MUSTACH_ERROR_SYSTEM            -1
+#define MUSTACH_ERROR_UNEXPECTED_END    -2
+#define MUSTACH_ERROR_EMPTY_TAG         -3
+#define MUSTACH_ERROR_TAG_TOO_LONG      -4
+#define MUSTACH_ERROR_BAD_SEPARATORS    -5
+#define MUSTACH_ERROR_TOO_DEEP          -6
+#define MUSTACH_ERROR_CLOSING           -7
+#define MUSTACH_ERROR_BAD_UNESCAPE_TAG  -8
+#define MUSTACH_ERROR_INVALID_ITF       -9
+#define MUSTACH_ERROR_ITEM_NOT_FOUND    -10
+#define MUSTACH_ERROR_PARTIAL_NOT_FOUND -11
+
+/*
+ * Flags specific to kore_mustach
+ *
+ * Mustach_With_LazyJson: kore_mustach() only indexes the structure of the
+ * json data and decodes the values the template uses, instead of parsing
+ * all of it first. Malformed strings, numbers or literals render as false.
+ *
+ * Mustach_With_FragmentCache: a section named 'cache:' followed by a key,
+ * as in {{#cache:product.id}}...{{/cache:product.id}}, renders its body in
+ * the current context and keeps the output in a process wide cache, reused
+ * by later renders for the same value of the key until it expires or is
+ * invalidated. @see kore_mustach_cache_size()
+ *
+ * Mustach_With_ParallelSections: a section over a json list long enough
+ * is rendered in chunks on a pool of threads, with the render taking its
+ * share, and their outputs are put back in order. Lambdas in such sections
+ * run on the pool threads. Only when kore_mustach is built with TASKS=1,
+ * against a kore built with tasks, otherwise sections render in sequence.
+ * @see kore_mustach_parallel()
+ */
+#define Mustach_With_LazyJson     65536
+#define Mustach_With_FragmentCache 131072
+#define Mustach_With_ParallelSections 262144
+
 /*
  * kore_mustach - Renders the mustache 'template' in 'result' for 'data'.
  *
@@ -47,6 +114,263 @@ int kore_mustach(const char *template, const char *data, int flags, struct kore_
  *              string it requires a kore_json_item object.
  */
 int kore_mustach_json(const char *template, struct kore_json_item *json, int flags, struct kore_buf **result);
+/*
+ * kore_mustach_json_cached - Same as kore_mustach_json except the output is
+ *              kept in the process wide cache, @see kore_mustach_cache_size(),
+ *              and given back as is for the same template, flags and data.
+ *              The output of lambdas must only depend on their section.
+ *
+ * @etag:       receives the strong entity tag of the output, quoted. Holds
+ *              KORE_MUSTACH_ETAG_LEN bytes. can be NULL
+ *
+ * The entity tag is a hash of the output itself, so every process gives
+ * the same one for the same page, across restarts and partial reloads.
+ */
+int kore_mustach_json_cached(const char *template, struct kore_json_item *json, int flags, struct kore_buf **result, char *etag);
+/*
+ * kore_mustach_http_cached - Responds to 'req' with the output of
+ *              kore_mustach_json_cached() and its etag, or with a 304 when
+ *              the If-None-Match header of a GET or HEAD request already
+ *              names it. A page still in the cache is not rendered again.
+ *
+ * Returns KORE_RESULT_OK in case of success or KORE_RESULT_ERROR in case of
+ * error, in which case nothing is sent.
+ */
+int kore_mustach_http_cached(struct http_request *req, int status, const char *template, struct kore_json_item *json, int flags);
+
+#define KORE_MUSTACH_ETAG_LEN   19
+
+/*
+ * kore_mustach_compile - Parses the mustache 'template' once into a reusable
+ *              program, so rendering it does not tokenize it again.
+ *
+ * @template:   the template string to compile. it is copied
+ * @flags:      the flags used to compile and render it
+ *
+ * Returns the compiled template or NULL in case of error. Free it with
+ * kore_mustach_template_free().
+ */
+struct kore_mustach_template *kore_mustach_compile(const char *template, int flags);
+/*
+ * kore_mustach_render - Same as kore_mustach_json except it renders an
+ *              already compiled template. A compiled template is never
+ *              modified by a render and can be rendered any number of times.
+ */
+int kore_mustach_render(struct kore_mustach_template *tpl, struct kore_json_item *json, struct kore_buf **result);
+/*
+ * kore_mustach_render_batch - Renders 'tpl' for each of the 'count' roots in
+ *              'items' on one render context, as for mail merges or reports.
+ *
+ * @concat:     if set, the outputs follow each other in a single buffer
+ * @results:    receives a kore_buf per item, or the single one with 'concat'
+ *
+ * Stops at the first render that fails and returns KORE_RESULT_ERROR with
+ * every result set to NULL, otherwise KORE_RESULT_OK. With a 'count' of 0
+ * nothing is rendered and 'results' is not touched, even with 'concat'.
+ */
+int kore_mustach_render_batch(struct kore_mustach_template *tpl, struct kore_json_item **items, size_t count, int concat, struct kore_buf **results);
+/*
+ * kore_mustach_render_list - Same as kore_mustach_render_batch except the
+ *              roots are the elements of the json array 'array', and
+ *              'results' has room for as many buffers as it has elements.
+ */
+int kore_mustach_render_list(struct kore_mustach_template *tpl, struct kore_json_item *array, int concat, struct kore_buf **results);
+/*
+ * kore_mustach_http - Renders 'tpl' for 'json' as the response to 'req'.
+ *
+ * @req:        the request to respond to
+ * @status:     the http status of the response
+ * @tpl:        the compiled template
+ * @json:       the kore_json_item object. can be NULL
+ * @chunk:      the output is sent as soon as this many bytes are rendered,
+ *              using a chunked response. 0 selects a default of 16 KiB
+ *
+ * A page that fits within the first chunk is sent as a plain response
+ * with a content-length, and so is any page asked for over HTTP/1.0, which
+ * has no chunked encoding, once it is rendered whole. Only the render buffer is bounded by 'chunk':
+ * chunks are queued on the connection as they are rendered, without
+ * waiting for the client to read them, so a slow client can still have
+ * most of a large page queued. Returns KORE_RESULT_OK in case of success or
+ * KORE_RESULT_ERROR in case of error. If the error happens before any
+ * output was sent nothing is sent, otherwise the connection is closed.
+ */
+int kore_mustach_http(struct http_request *req, int status, struct kore_mustach_template *tpl, struct kore_json_item *json, size_t chunk);
+/*
+ * kore_mustach_render_segments - Renders 'tpl' for 'json' as a list of
+ *              segments to send with writev(2), instead of a single buffer.
+ *
+ * @tpl:        the compiled template
+ * @json:       the kore_json_item object. can be NULL
+ * @segs:       receives the segments, to free with kore_mustach_segments_free()
+ *
+ * Long runs of template text and json strings with nothing to escape are
+ * not copied, their segments point into 'tpl', the partials it used and
+ * 'json', which must outlive 'segs'. The rest of the output is copied into
+ * a buffer held by 'segs' as usual. Returns KORE_RESULT_OK in case of
+ * success or KORE_RESULT_ERROR in case of error, with 'segs' set to NULL.
+ */
+int kore_mustach_render_segments(struct kore_mustach_template *tpl, struct kore_json_item *json, struct kore_mustach_segments **segs);
+/*
+ * kore_mustach_segments_iov - Returns the segments of 'segs' in order and
+ *              their number in 'count', which may exceed IOV_MAX. 'length'
+ *              receives the size of the whole output. can be NULL
+ */
+const struct iovec *kore_mustach_segments_iov(struct kore_mustach_segments *segs, int *count, size_t *length);
+/* kore_mustach_segments_free - Frees 'segs' and releases what it points into */
+void kore_mustach_segments_free(struct kore_mustach_segments *segs);
+/*
+ * kore_mustach_http_segments - Same as kore_mustach_http() with the output
+ *              rendered by kore_mustach_render_segments() and handed to the
+ *              connection with net_send_stream(), without a chunk size since
+ *              the response always has a content-length.
+ *
+ * The segments are sent from where they are and freed once the last one is
+ * sent or the connection is gone. Json strings are copied, as 'json' is
+ * usually freed when the handler returns, template text is not: 'tpl' and
+ * its partials must outlive the response, as templates compiled once for
+ * the process do.
+ */
+int kore_mustach_http_segments(struct http_request *req, int status, struct kore_mustach_template *tpl, struct kore_json_item *json);
+/*
+ * kore_mustach_template_size_hint - The result buffer of a render of 'tpl' is
+ *              allocated up front to fit what its past renders produced. This
+ *              sets the least it starts out with, in bytes, for instance the
+ *              size of a typical page before there are renders to learn from.
+ */
+void kore_mustach_template_size_hint(struct kore_mustach_template *tpl, size_t size);
+/*
+ * kore_mustach_specialize - Renders what 'tpl' takes from the static data
+ *              'json' ahead of time, returning the residual template that
+ *              is left to render with the data of each request.
+ *
+ * @tpl:        the compiled template
+ * @json:       the static kore_json_item object, not needed afterwards
+ *
+ * Tags and sections found in 'json' are folded into text, others are kept
+ * with their bodies specialized in turn. Partials are inlined as they are
+ * at the time of the call. Rendering the result gives what rendering 'tpl'
+ * on an object holding the members of both would, provided the request
+ * data has no member named like one at the top of 'json'. Inside a section
+ * on request data, only the names at the top of 'json' are folded. Lambdas
+ * always run with the request and only see its data, as do partials taken
+ * from the request data and a '*' section on the root.
+ *
+ * Returns the residual template or NULL in case of error. Free it with
+ * kore_mustach_template_free().
+ */
+struct kore_mustach_template *kore_mustach_specialize(struct kore_mustach_template *tpl, struct kore_json_item *json);
+/* kore_mustach_template_free - Free a template returned by kore_mustach_compile */
+void kore_mustach_template_free(struct kore_mustach_template *tpl);
+
+/*
+ * kore_mustach_partial_check - Partials read from files are compiled once and
+ *              cached for every later render, and names found that way are
+ *              no longer looked up in the json data. A cached file is checked
+ *              for changes when at least 'msec' milliseconds went by since the
+ *              last check, 1000 by default. 0 checks it on every use. A
+ *              name that is not a file is not looked for again sooner either.
+ */
+void kore_mustach_partial_check(u_int64_t msec);
+
+/*
+ * kore_mustach_cache_size - The output of cache sections and of cached
+ *              renders is kept until it takes more than 'size' bytes, 1 MiB
+ *              by default, and the least recently used goes first. 0
+ *              disables the cache.
+ */
+void kore_mustach_cache_size(size_t size);
+/* kore_mustach_cache_ttl - Cached output expires after 'msec' milliseconds, 60000 by default. 0 never expires */
+void kore_mustach_cache_ttl(u_int64_t msec);
+/*
+ * kore_mustach_cache_invalidate - Drops the cached output of the sections
+ *              keyed 'name', as written after 'cache:', for the key value
+ *              'value'. A NULL 'value' drops all of that key, a NULL 'name'
+ *              every key with that value. Both NULL drop cached renders too.
+ */
+void kore_mustach_cache_invalidate(const char *name, const char *value);
+
+/*
+ * kore_mustach_parallel - With Mustach_With_ParallelSections, sections over
+ *              at least 'min' items, 1000 by default, are cut in chunks for
+ *              up to 'threads' pool threads, 4 by default. The threads are
+ *              started by the first render that needs them. 0 threads
+ *              renders every section in sequence.
+ *
+ * Under seccomp, the filter of the workers must allow clone(2), clone3
+ * with recent C libraries, and what threads use besides, such as futex(2),
+ * mprotect(2) and set_robust_list(2), or the worker is killed when the first
+ * thread starts. Add those kore does not allow with KORE_SECCOMP_FILTER().
+ */
+void kore_mustach_parallel(size_t min, int threads);
+
+/*
+ * A render context carries everything a render works on: the json context
+ * stack, the lookup index and the error state. Calls given their own
+ * context share nothing with each other, so they can run on different
+ * threads or from within a lambda. The calls without a context are safe
+ * per thread and can be nested as well.
+ */
+
+/*
+ * kore_mustach_ctx_alloc - Allocate a render context, reusable across renders.
+ *              A context keeps its working memory from one render to the
+ *              next, so rendering on the same one allocates next to nothing.
+ */
+struct kore_mustach_ctx *kore_mustach_ctx_alloc(void);
+/* kore_mustach_ctx_free - Free a context returned by kore_mustach_ctx_alloc */
+void kore_mustach_ctx_free(struct kore_mustach_ctx *ctx);
+/*
+ * kore_mustach_render_ctx - Same as kore_mustach_render except its error
+ *              state is kept in 'ctx'. A context renders one template at a
+ *              time, a nested render needs a context of its own.
+ */
+int kore_mustach_render_ctx(struct kore_mustach_ctx *ctx, struct kore_mustach_template *tpl, struct kore_json_item *json, struct kore_buf **result);
+
+/*
+ * Data need not be a kore_json_item tree: a provider renders it from the
+ * application's own structures, whatever they are. Items are pointers the
+ * provider hands out and gets back, the render only ever passes them on.
+ * 'arg' is the pointer given to kore_mustach_render_data().
+ *
+ * kind:        the KORE_MUSTACH_ kind of 'item'
+ * member:      the member 'name', 'len' bytes long and not terminated, of
+ *              'object', or NULL if there is none or 'object' is no object
+ * first:       the first element of a list, or the first member of an
+ *              object when its members are iterated. NULL if it is empty
+ * next:        the element or member after 'item' in 'list', or NULL
+ * name:        the member name of 'item', used for '*' and to call a
+ *              lambda. optional
+ * tostring:    appends the text of 'item' to 'buf'
+ * compare:     compares 'item' to the operand 'value' of a comparison,
+ *              returning less than, equal to or greater than 0 like
+ *              strcmp(3). optional, items are compared as their text otherwise
+ */
+struct kore_mustach_provider {
+    int         (*kind)(void *arg, void *item);
+    void        *(*member)(void *arg, void *object, const char *name, size_t len);
+    void        *(*first)(void *arg, void *item);
+    void        *(*next)(void *arg, void *list, void *item);
+    const char  *(*name)(void *arg, void *item);
+    void        (*tostring)(void *arg, void *item, struct kore_buf *buf);
+    int         (*compare)(void *arg, void *item, const char *value);
+};
+
+#define KORE_MUSTACH_FALSE      0   /* false or null, its sections are skipped */
+#define KORE_MUSTACH_TRUE       1   /* its sections are rendered once */
+#define KORE_MUSTACH_VALUE      2   /* string or number */
+#define KORE_MUSTACH_OBJECT     3   /* has members, its sections render in it */
+#define KORE_MUSTACH_LIST       4   /* its sections render for each element */
+#define KORE_MUSTACH_LAMBDA     5   /* calls the lambda registered under its name */
+
+/*
+ * kore_mustach_render_data - Same as kore_mustach_render except the data is
+ *              reached through 'provider', starting from the object 'root'.
+ *              kore_mustach_find() finds nothing in such a render, use
+ *              kore_mustach_lookup() instead.
+ */
+int kore_mustach_render_data(struct kore_mustach_template *tpl, const struct kore_mustach_provider *provider, void *arg, void *root, struct kore_buf **result);
+/* kore_mustach_render_data_ctx - Same as above on the render context 'ctx' */
+int kore_mustach_render_data_ctx(struct kore_mustach_ctx *ctx, struct kore_mustach_template *tpl, const struct kore_mustach_provider *provider, void *arg, void *root, struct kore_buf **result);
 
 /*
  * A lambda must be a string consisting only of '(=>)' in the json hash.
@@ -56,16 +380,69 @@ int kore_mustach_json(const char *template, struct kore_json_item *json, int fla
  * 'buf' contains the text within the lambda's tags, already rendered.
  *
  * If you need to look up a kore_json_item in the context use kore_mustach_find().
- * The lambda will be searched using kore_runtime_getcall(), which uses dlsym(3).
+ * Lambdas registered with kore_mustach_register_lambda() are used first, any
+ * other name is searched once using kore_runtime_getcall(), which uses dlsym(3),
+ * and the outcome is cached.
+ *
+ * A lambda registered with kore_mustach_register_lambda_ctx() is also given
+ * the context of the render calling it, to look up items with
+ * kore_mustach_find_ctx():
+ *      void (*cb)(struct kore_mustach_ctx *ctx, struct kore_buf *buf)
+ *
+ * A lambda registered with kore_mustach_register_lambda_inplace() is not
+ * handed a buffer of its own but the one its section was rendered in, to
+ * rewrite the text from 'offset' up to buf->offset where it lies:
+ *      void (*cb)(struct kore_mustach_ctx *ctx, struct kore_buf *buf, size_t offset)
+ * It may append to 'buf' and move buf->offset, but must leave the bytes
+ * before 'offset' as they are. Sections of such lambdas, nested or not,
+ * are rendered without copying their text around.
  * */
 
+/*
+ * kore_mustach_register_lambda - Registers 'cb' as the lambda called 'name',
+ *              replacing any previous one. Best done at module init, before
+ *              any render. A NULL 'cb' disables the lambda.
+ */
+void kore_mustach_register_lambda(const char *name, void (*cb)(struct kore_buf *));
+/* kore_mustach_register_lambda_ctx - Same as above for a lambda taking the render context */
+void kore_mustach_register_lambda_ctx(const char *name, void (*cb)(struct kore_mustach_ctx *, struct kore_buf *));
+/* kore_mustach_register_lambda_inplace - Same as above for a lambda working in place */
+void kore_mustach_register_lambda_inplace(const char *name, void (*cb)(struct kore_mustach_ctx *, struct kore_buf *, size_t));
+
 /* kore_mustach_errno - Return mustach's error code */
 int kore_mustach_errno(void);
 
 /* kore_mustach_strerror - Return mustach's error as string */
 const char *kore_mustach_strerror(void);
 
-/* kore_mustach_find - Find kore_json_item of 'name' */
+/* kore_mustach_find - Find kore_json_item of 'name' in the render running on this thread */
 struct kore_json_item *kore_mustach_find(const char *name);
 
+/*
+ * kore_mustach_lookup - Find the item of 'name' in the render running on this
+ *              thread, a kore_json_item or an item of its provider.
+ */
+void *kore_mustach_lookup(const char *name);
+
+/* kore_mustach_errno_ctx - Return the error code of the last render on 'ctx' */
+int kore_mustach_errno_ctx(struct kore_mustach_ctx *ctx);
+
+/* kore_mustach_strerror_ctx - Return the error of the last render on 'ctx' as string */
+const char *kore_mustach_strerror_ctx(struct kore_mustach_ctx *ctx);
+
+/* kore_mustach_find_ctx - Find kore_json_item of 'name' in the render running on 'ctx' */
+struct kore_json_item *kore_mustach_find_ctx(struct kore_mustach_ctx *ctx, const char *name);
+
+/* kore_mustach_lookup_ctx - Same as kore_mustach_lookup for the render running on 'ctx' */
+void *kore_mustach_lookup_ctx(struct kore_mustach_ctx *ctx, const char *name);
+
+/* kore_mustach_stats_ctx - Copy the stats of the last render on 'ctx' to 'stats' */
+void kore_mustach_stats_ctx(struct kore_mustach_ctx *ctx, struct kore_mustach_stats *stats);
+
+/*
+ * kore_mustach_stats_log - Log the stats of every render taking 'usec'
+ *              microseconds or more with kore_log(). 0, the default, logs none.
+ */
+void kore_mustach_stats_log(u_int64_t usec);
+
 #endif